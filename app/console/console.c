@@ -118,6 +118,9 @@ int main(int argc, char* argv[])
     if((ret = neobox_init_custom(options)) < 0)
         return ret;
     
+    // only keyboard chars are handled, no buttons, powersave or gestures
+    neobox_subscribe(0);
+    
     if(!tty && !(tty = neobox_config("tty", 0)))
     {
         neobox_app_fprintf(stderr, "TTY not configured\n");
@@ -41,6 +41,7 @@
 #include "lock_layout.h"
 
 #define BRIGHTNESS_LEN_MAX 20
+#define LOCK_TIMEOUT 1000 // ms
 
 char *pass, **cmd, *brightness_dev, brightness_value[BRIGHTNESS_LEN_MAX];
 pid_t cmd_pid;
@@ -160,13 +161,16 @@ int handler(struct neobox_event event, void *state)
             if(!event.value.i)
                 break;
             powersave = !powersave;
-powersave:  if(neobox_lock(powersave))
-                printf("Failed to %s screen\n", powersave?"lock":"unlock");
+powersave:  neobox_lock_async(powersave, LOCK_TIMEOUT);
             set_brightness(!powersave);
             neobox_powersave(powersave);
             break;
         }
         return NEOBOX_HANDLER_SUCCESS;
+    case NEOBOX_EVENT_LOCK:
+        if(event.value.i)
+            printf("Failed to %s screen\n", event.id?"lock":"unlock");
+        return NEOBOX_HANDLER_SUCCESS;
     case NEOBOX_EVENT_SIGNAL:
         switch(event.value.i)
         {
@@ -41,6 +41,7 @@
 #include "login_layout.h"
 
 #define LEN 9
+#define LOCK_TIMEOUT 1000 // ms
 
 unsigned int seeds[26];
 char tile[LEN], rand_tile[LEN*2], current_tile;
@@ -202,16 +203,14 @@ int handler(struct neobox_event event, void *state)
                 break;
 powersave:  if(!powersave)
             {
-                if(neobox_lock(1))
-                    neobox_app_printf("Failed to lock screen\n");
+                neobox_lock_async(1, LOCK_TIMEOUT);
                 zero_brightness();
                 neobox_powersave(1);
                 powersave = 1;
             }
             else
             {
-                if(neobox_lock(0))
-                    neobox_app_printf("Failed to unlock screen\n");
+                neobox_lock_async(0, LOCK_TIMEOUT);
                 restore_brightness();
                 neobox_switch(0);
                 neobox_powersave(0);
@@ -220,6 +219,10 @@ powersave:  if(!powersave)
             break;
         }
         return NEOBOX_HANDLER_SUCCESS;
+    case NEOBOX_EVENT_LOCK:
+        if(event.value.i)
+            neobox_app_printf("Failed to %s screen\n", event.id?"lock":"unlock");
+        return NEOBOX_HANDLER_SUCCESS;
     case NEOBOX_EVENT_SIGNAL:
         switch(event.value.i)
         {
@@ -236,6 +236,9 @@ int main(int argc, char* argv[])
     if((ret = neobox_init_custom(options)) < 0)
         return ret;
     
+    // menu keys and app signals only, no buttons, powersave or gestures
+    neobox_subscribe(0);
+    
     active = 1;
     verbose = 0;
     
@@ -73,6 +73,9 @@ int main(int argc, char* argv[])
     
     if((ret = neobox_init_layout(sliderLayout, &argc, argv)) < 0)
         return ret;
+    
+    // only the slider value is handled, no buttons, powersave or gestures
+    neobox_subscribe(0);
 
     if(argc != 4)
     {
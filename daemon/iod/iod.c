@@ -20,26 +20,63 @@
  * THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdio.h>
-#include <poll.h>
 #include <string.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <stdint.h>
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
 #include <libgen.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <linux/input.h>
+#include <linux/sockios.h>
 
 #include "iod.h"
+#include "iod_ring.h"
+#include "iod_hist.h"
+#include "iod_trace.h"
+#include "iod_rt.h"
+#include "iod_uring.h"
 
 #define BYTES_PER_CMD   16
 #define MIN_PIXEL       100
+#define INPUT_BATCH     64  // input_events read per device read
+#define INPUT_SLACK     4   // room for the device state of a resync
+#define INPUT_RING      4096 // input_events from reader thread, power of 2
+#define INPUT_BUDGET    4   // ring batches handled per wakeup
+#define EPOLL_EVENTS    16  // ready fds per epoll_wait
+#define PID_HASH_SIZE   64  // pid hash buckets, power of 2
+#define BACKLOG         64  // default pending events per client
+#define FRAME_EVENTS    32  // events per sent frame
+#define CMD_BUFFER      256 // bytes of received commands
+#define FILTER_SAMPLES  16  // max touch smoothing window
+#define ORDER_GAP       (1ULL<<32)  // app ring position spacing
+#define GESTURE_SLOP    20  // pixels moved still counting as tap or long press
+#define GESTURE_SWIPE   60  // min pixels moved for a swipe
+#define GESTURE_TAP     300 // ms, max tap duration
+#define GESTURE_DOUBLE  400 // ms, max time between taps of a double tap
+#define GESTURE_LONG    600 // ms, min long press duration
+#define SWITCH_DEADLINE 500 // ms, default wait for DEACTIVATED ACK
+#define URING_ENTRIES   64  // io_uring submission queue entries
+#define REGION_CELL     32  // pixels per side of a region lookup cell
+#define REGION_CELLS    32  // lookup cells per side, points beyond are scanned
+#define TOPIC_MAX       32  // topics with subscribers, bits of a topic mask
+#define MESSAGE_POOL    256 // messages queued to subscribers
+#define CMD_FDS         4   // received fds kept for commands
+#define STATS_TIMEOUT   50  // ms, max wait for a stats reader
 
 #ifdef NDEBUG
 #   define DEBUG(x)
@@ -50,25 +87,202 @@
 
 struct chain_socket
 {
-    CIRCLEQ_ENTRY(chain_socket) chain;
+    struct chain_socket *next, *prev;   // app ring, all apps
+    struct chain_socket *vnext, *vprev; // visible apps in app ring order
+    unsigned long long order;           // position in app ring
+    int heap;                           // index in hidden heap
+    LIST_ENTRY(chain_socket) hash;
     int sock;
     unsigned char priority, hide, lock;
     pid_t pid;
+    int version;                // protocol version
+    int classes;                // subscribed event classes
+    LIST_ENTRY(chain_socket) powersave; // in powersave_list if subscribed
+    
+    struct iod_tevent *queue;   // pending events ring, backlog entries
+    int qhead, qcount;          // first pending event, pending events
+    int qframe, qsent;          // events in frame being sent, bytes sent
+    int qv1;                    // pending events queued before v2 switch
+    int qmax;                   // max queue depth seen
+    int pollout, dead;          // waiting for writable, backlog exceeded
+    int sending, flushing;      // io_uring send in flight, in flush_list
+    LIST_ENTRY(chain_socket) flush;
+    struct msghdr msg;          // io_uring frame in flight
+    struct iovec iov[FRAME_EVENTS+1];
+    struct iod_frame frame;
+    int msize;                  // bytes of the frame in flight
+    unsigned long sent;         // events sent
+    unsigned long dropped;      // events lost on backlog overflow
+    unsigned long coalesced;    // MOVED events merged in queue
+    unsigned long unsubscribed; // events of unsubscribed classes
+    unsigned long late;         // DEACTIVATED ACKs missing the deadline
+    struct iod_region region;   // claimed touch region, empty if none
+    int z;                      // z order of the region, higher on top
+    struct iod_hist latency;    // input event to client socket/ring
+    unsigned int topics;        // subscribed topics, bit per topic
+    struct iod_tevent mevent;   // message event being sent
+    char cbuf[CMSG_SPACE(sizeof(int))]; // shared memory of the message
+    
+    struct iod_ring *ring;      // shared event ring
+    int ring_fd;                // ring doorbell
+    int ring_later;             // ring requested during an io_uring send
+    unsigned long doorbells;    // doorbells rung
+    
+    char in[CMD_BUFFER];        // received commands
+    int in_size, in_pos;        // bytes received, bytes handled
+    int in_left, in_rsize;      // records left in v2 frame, record size
+    int in_fds[CMD_FDS];        // received fds, taken by IOD_CMD_PUBLISH
+    int in_nfds;
+};
+LIST_HEAD(pid_bucket, chain_socket);
+LIST_HEAD(client_list, chain_socket);
+
+struct touch_state
+{
+    int status;     // 0 released, 1 pressed, 2 moving
+    int pressed;    // PRESSED sent
+    int pressure;   // current pressure
+    int ry, rx;     // current raw position
+    int y, x;       // current filtered position
+    int ay, ax;     // last sent position, dead zone center
+    int sy[FILTER_SAMPLES], sx[FILTER_SAMPLES]; // smoothing window
+    int shead, scount;
+    int moved;      // MOVED frame held back
+    int my, mx;     // position of held back MOVED frame
+    struct timeval time, mtime; // time of frame, held back MOVED frame
+    struct chain_socket *target; // region client of the sequence, 0 for active
+    int orphan;     // target removed, rest of the sequence is dropped
+};
+
+struct gesture_state
+{
+    int state;      // 0 idle, 1 pressed, 2 moving, 3 long press sent
+    int y, x;       // press position
+    int64_t time;   // press time, us
+    int ty, tx;     // last tap position
+    int64_t ttime;  // last tap time, 0 if none or part of a double tap
+};
+
+struct input_sync
+{
+    int key;        // key of the device, BTN_TOUCH, KEY_PHONE or KEY_POWER
+    int value;      // last key value passed on
+    int dropped;    // SYN_DROPPED, skipping to the next SYN_REPORT
+};
+
+union cmd_fields
+{
+    struct iod_region region;
+    struct iod_message message;
+};
+
+// command with the appended fields known to iod
+struct client_cmd
+{
+    struct iod_cmd cmd;
+    union cmd_fields fields;
+} __attribute__((packed));
+
+struct topic
+{
+    char name[IOD_TOPIC_SIZE];
+    int subscribers;            // unused if 0
+};
+
+struct message_entry
+{
+    int refs;                   // queued events, free if 0
+    int fd;                     // shared memory, -1 if inline
+    pid_t pid;                  // publisher
+    struct iod_message message;
+};
+
+struct region_cell
+{
+    struct chain_socket *cs;    // topmost region touching the cell
+    int whole;                  // cs covers the whole cell
+};
+
+struct input_entry
+{
+    int device;
+    struct input_event input;
+};
+
+// Single producer (reader thread) single consumer (main loop) input
+// ring, same protocol as iod_ring, input_efd is the doorbell.
+struct input_ring
+{
+    unsigned int head, tail, waiting;
+    struct input_entry entries[INPUT_RING];
 };
-CIRCLEQ_HEAD(client_sockets, chain_socket);
 
+struct input_stats
+{
+    unsigned long reads;    // device reads
+    unsigned long events;   // input_events read
+    unsigned long frames;   // SYN_REPORT frames
+    unsigned long merged;   // MOVED frames merged into a newer one
+    unsigned long filtered; // frames dropped by pressure or dead zone
+    unsigned long gestures; // gestures recognized
+    unsigned long resyncs;  // SYN_DROPPED, events lost in the kernel
+    struct iod_hist latency; // input event to iod
+};
 
-int screen_fd, aux_fd, power_fd, sock;
-int client_count, pfds_cap;
-struct client_sockets client_list;
+
+int screen_fd, aux_fd, power_fd, sock, stats_sock, gesture_fd, switch_fd, epfd;
+struct chain_socket *active;     // app ring head
+struct chain_socket **hidden;   // hidden apps, max heap on priority
+int hidden_count, hidden_size;
+struct chain_socket **regions;  // region clients, topmost first
+int region_count, region_size;
+struct region_cell region_cells[REGION_CELLS][REGION_CELLS];
+struct topic topics[TOPIC_MAX];
+struct message_entry messages[MESSAGE_POOL]; // referenced by queued events
+int message_next;                   // next pool entry tried
+unsigned long published, messages_dropped;
+struct pid_bucket pid_hash[PID_HASH_SIZE];
+struct client_list powersave_list;  // POWERSAVE subscribers
 char *pwd, *screen_dev, *aux_dev, *power_dev;
-struct pollfd *pfds;
+int backlog;
+int pressure_min, dead_zone;    // touch filter, 0 disables
+int smooth, smooth_median;      // smoothing window, median else average
+int switch_deadline;            // ms, 0 waits for the ACK forever
+int realtime;                   // SCHED_FIFO priority, 0 if not realtime
+int uring_loop;                 // io_uring main loop, clients stay on epoll
+
+int lock, aux_pressed, power_pressed;
+struct chain_socket *aux_grabber, *power_grabber;
+struct touch_state touch;
+struct gesture_state gesture;
+struct chain_socket *switching; // deactivated app, ACK pending
+long long switch_start;         // first pending switch, 0 if none
+unsigned long switches_forced;  // switches completed by the deadline
+unsigned long stats_truncated;  // snapshots cut off by a slow reader
+struct iod_hist switch_latency; // deactivation to activation
+struct input_event inputs[INPUT_BATCH+INPUT_SLACK];
+struct input_stats screen_stats, aux_stats, power_stats;
+struct input_sync syncs[IOD_TRACE_DEVICES] = { { BTN_TOUCH }, { KEY_PHONE }, { KEY_POWER } };
+int threaded, input_efd, input_epfd; // input read by reader thread
+volatile int input_error;           // reader thread gave up, exit code
+struct input_ring input_ring;
+unsigned long input_full;           // reader thread waits on full ring
+volatile sig_atomic_t dump_stats;
+unsigned long wakeups;              // epoll_wait returns
+long long start_time, stats_time;   // start, last snapshot
+unsigned long stats_wakeups;        // wakeups at last snapshot
+FILE *trace;                        // input trace, 0 if not recording
+struct iod_uring uring;
+struct client_list flush_list;      // clients with sends to submit
+struct input_event uring_inputs[IOD_TRACE_DEVICES][INPUT_BATCH];
 
 
-int open_socket(int *sock, struct sockaddr_un *addr)
+int open_socket(int *sock, const char *name)
 {
-    addr->sun_family = AF_UNIX;
-    sprintf(addr->sun_path, "%s/%s", pwd, IOD_SOCK);
+    struct sockaddr_un addr;
+    
+    addr.sun_family = AF_UNIX;
+    sprintf(addr.sun_path, "%s/%s", pwd, name);
     
     if((*sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
     {
@@ -76,13 +290,13 @@ int open_socket(int *sock, struct sockaddr_un *addr)
         return 11;
     }
     
-    if(unlink(addr->sun_path) == -1 && errno != ENOENT)
+    if(unlink(addr.sun_path) == -1 && errno != ENOENT)
     {
         perror("Failed to unlink socket file");
         return 12;
     }
     
-    if(bind(*sock, (struct sockaddr*)addr, sizeof(struct sockaddr_un)) == -1)
+    if(bind(*sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1)
     {
         perror("Failed to bind socket");
         return 13;
@@ -93,311 +307,2887 @@ int open_socket(int *sock, struct sockaddr_un *addr)
     return 0;
 }
 
-void add_client(int fd)
+int watch_fd(int fd, void *ptr)
 {
-    struct chain_socket *cs = calloc(1, sizeof(struct chain_socket));
-    CIRCLEQ_INSERT_HEAD(&client_list, cs, chain);
-    cs->sock = fd;
-    if(client_count+4 == pfds_cap)
+    struct epoll_event ev;
+    
+    // ptr identifies the source, either a client or one of the global fds
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
     {
-        pfds_cap += 10;
-        pfds = realloc(pfds, pfds_cap*sizeof(struct pollfd));
+        perror("Failed to watch fd");
+        return -1;
     }
-    pfds[client_count+4].fd = fd;
-    pfds[client_count+4].events = POLLIN;
-    client_count++;
-    DEBUG(printf("Client added [%i]\n", fd));
+    
+    return 0;
+}
+
+#define FOREACH_CLIENT(cs) \
+    for(cs = active; cs; cs = cs->next != active ? cs->next : 0)
+
+// The app ring keeps the order in which apps are switched, active is
+// its head. Visible apps are linked in ring order as well, hidden apps
+// are kept in a heap on priority. Positions in the ring are labelled
+// increasingly from an arbitrary origin to break priority ties.
+
+int heap_before(struct chain_socket *cs, struct chain_socket *cs2)
+{
+    return cs->priority > cs2->priority;
+}
+
+void heap_set(int i, struct chain_socket *cs)
+{
+    hidden[i] = cs;
+    cs->heap = i;
 }
 
-int send_client(unsigned char event, union iod_value value, struct chain_socket *cs)
+void heap_up(int i)
 {
-    struct iod_event evnt;
-    char *ptr = (char*)&evnt;
-    int count, size = sizeof(struct iod_event);
+    struct chain_socket *cs = hidden[i];
     
-    if(client_list.cqh_first == (void*)&client_list)
-        return 0;
+    for(; i && heap_before(cs, hidden[(i-1)/2]); i = (i-1)/2)
+        heap_set(i, hidden[(i-1)/2]);
+    heap_set(i, cs);
+}
+
+void heap_down(int i)
+{
+    struct chain_socket *cs = hidden[i];
+    int child;
     
-    evnt.event = event;
-    evnt.value = value;
+    while((child = 2*i+1) < hidden_count)
+    {
+        if(child+1 < hidden_count && heap_before(hidden[child+1], hidden[child]))
+            child++;
+        if(!heap_before(hidden[child], cs))
+            break;
+        heap_set(i, hidden[child]);
+        i = child;
+    }
+    heap_set(i, cs);
+}
+
+void heap_push(struct chain_socket *cs)
+{
+    if(hidden_count == hidden_size)
+    {
+        hidden_size = hidden_size ? 2*hidden_size : 8;
+        hidden = realloc(hidden, hidden_size*sizeof(struct chain_socket*));
+    }
     
-    if(!cs)
-        cs = client_list.cqh_first;
+    heap_set(hidden_count++, cs);
+    heap_up(cs->heap);
+}
+
+void heap_remove(struct chain_socket *cs)
+{
+    int i = cs->heap;
     
-    while((count = send(cs->sock, ptr, size, MSG_NOSIGNAL)) != size)
+    if(i != --hidden_count)
     {
-        if(count == -1)
-        {
-            DEBUG(perror("Failed to send client event"));
-            return -1;
-        }
-        ptr += count;
-        size -= count;
+        heap_set(i, hidden[hidden_count]);
+        heap_up(i);
+        heap_down(hidden[i]->heap);
     }
+}
+
+// distance from active in ring order
+unsigned long long stack_distance(struct chain_socket *cs)
+{
+    return cs->order - active->order;
+}
+
+// first hidden app from active with the top priority
+struct chain_socket* stack_hidden_top(int i, struct chain_socket *best)
+{
+    if(i >= hidden_count || hidden[i]->priority != hidden[0]->priority)
+        return best;
     
-    return 0;
+    if(!best || stack_distance(hidden[i]) < stack_distance(best))
+        best = hidden[i];
+    
+    best = stack_hidden_top(2*i+1, best);
+    return stack_hidden_top(2*i+2, best);
 }
 
-void send_client_cord(unsigned char event, short int y, short int x, struct chain_socket *cs)
+// next visible app in direction, 0 if none
+struct chain_socket* stack_next_visible(struct chain_socket *cs, int dir)
 {
-    union iod_value value;
+    struct chain_socket *cs2 = cs;
     
-    value.cord.y = y;
-    value.cord.x = x;
+    if(!cs->hide)
+        return dir > 0 ? cs->vnext : cs->vprev;
     
-    send_client(event, value, cs);
+    // walks over hidden apps only
+    do
+        cs2 = dir > 0 ? cs2->next : cs2->prev;
+    while(cs2->hide && cs2 != cs);
+    
+    return cs2->hide ? 0 : cs2;
 }
 
-void send_client_status(unsigned char event, int status, struct chain_socket *cs)
+void stack_show(struct chain_socket *cs)
 {
-    union iod_value value;
+    struct chain_socket *cs2 = cs->next;
     
-    value.status = status;
+    // link before the next visible app in ring order
+    while(cs2 != cs && cs2->hide)
+        cs2 = cs2->next;
+    
+    if(cs2 == cs)
+        cs->vnext = cs->vprev = cs;
+    else
+    {
+        cs->vnext = cs2;
+        cs->vprev = cs2->vprev;
+        cs2->vprev->vnext = cs;
+        cs2->vprev = cs;
+    }
+}
+
+void stack_unshow(struct chain_socket *cs)
+{
+    cs->vprev->vnext = cs->vnext;
+    cs->vnext->vprev = cs->vprev;
+}
+
+void stack_relabel()
+{
+    struct chain_socket *cs, *origin = active;
+    unsigned long long order = ORDER_GAP;
+    
+    while(origin->prev->order < origin->order)
+        origin = origin->prev;
+    
+    cs = origin;
+    do
+    {
+        cs->order = order;
+        order += ORDER_GAP;
+    }
+    while((cs = cs->next) != origin);
+}
+
+// insert before active and activate
+void stack_insert(struct chain_socket *cs)
+{
+    struct chain_socket *prev;
+    
+    if(!active)
+    {
+        cs->next = cs->prev = cs;
+        cs->vnext = cs->vprev = cs;
+        cs->order = ORDER_GAP;
+        active = cs;
+        return;
+    }
+    
+    prev = active->prev;
+    
+    // behind the last position or between two
+    if(prev->order >= active->order)
+    {
+        if(prev->order > ~0ULL - ORDER_GAP)
+            stack_relabel();
+        cs->order = active->prev->order + ORDER_GAP;
+    }
+    else
+    {
+        if(active->order - prev->order < 2)
+            stack_relabel();
+        cs->order = prev->order + (active->order - prev->order)/2;
+    }
     
-    send_client(event, value, cs);
+    cs->next = active;
+    cs->prev = prev;
+    prev->next = cs;
+    active->prev = cs;
+    
+    stack_show(cs);
+    active = cs;
+}
+
+void stack_remove(struct chain_socket *cs)
+{
+    if(cs->hide)
+        heap_remove(cs);
+    else
+        stack_unshow(cs);
+    
+    // like removing a list head, active moves to the next app
+    if(cs->next == cs)
+        active = 0;
+    else
+    {
+        cs->prev->next = cs->next;
+        cs->next->prev = cs->prev;
+        if(active == cs)
+            active = cs->next;
+    }
 }
 
-int recv_client(int sock, struct iod_cmd *cmd)
+void stack_hide(struct chain_socket *cs, int priority, int hide)
 {
-    char *ptr = (char*)cmd;
-    int count, size = sizeof(struct iod_cmd);
+    int priority_old = cs->priority;
+    
+    cs->priority = priority;
     
-    while((count = recv(sock, ptr, size, 0)) != size)
+    if(!cs->hide != !hide)
     {
-        if(count == -1)
+        if(hide)
         {
-            DEBUG(perror("Failed to recv client cmd"));
-            return -1;
+            stack_unshow(cs);
+            cs->hide = hide;
+            heap_push(cs);
         }
-        ptr += count;
-        size -= count;
+        else
+        {
+            heap_remove(cs);
+            cs->hide = hide;
+            stack_show(cs);
+        }
+    }
+    else if(hide && priority != priority_old)
+    {
+        heap_up(cs->heap);
+        heap_down(cs->heap);
+    }
+    
+    cs->hide = hide;
+}
+
+// Touch regions are kept topmost first, newer claims above older ones
+// of the same z order. The cells of a coarse grid remember the topmost
+// region touching them, only cells on region borders need a scan.
+
+int region_contains(struct chain_socket *cs, int y, int x)
+{
+    return y >= cs->region.y && y < cs->region.y+cs->region.height
+        && x >= cs->region.x && x < cs->region.x+cs->region.width;
+}
+
+void region_build()
+{
+    struct iod_region *r;
+    struct region_cell *cell;
+    int i, cy, cx, cy2, cx2;
+    
+    memset(region_cells, 0, sizeof(region_cells));
+    
+    // bottom up, higher regions overwrite
+    for(i=region_count-1; i>=0; i--)
+    {
+        r = &regions[i]->region;
+        cy2 = (r->y+r->height-1)/REGION_CELL;
+        cx2 = (r->x+r->width-1)/REGION_CELL;
+        if(r->y+r->height <= 0 || r->x+r->width <= 0)
+            continue;
+        for(cy=r->y < 0 ? 0 : r->y/REGION_CELL; cy<=cy2 && cy<REGION_CELLS; cy++)
+            for(cx=r->x < 0 ? 0 : r->x/REGION_CELL; cx<=cx2 && cx<REGION_CELLS; cx++)
+            {
+                cell = &region_cells[cy][cx];
+                cell->cs = regions[i];
+                cell->whole = r->y <= cy*REGION_CELL && r->x <= cx*REGION_CELL
+                    && r->y+r->height >= (cy+1)*REGION_CELL
+                    && r->x+r->width >= (cx+1)*REGION_CELL;
+            }
+    }
+}
+
+// client of the topmost region at the point, 0 for the active app
+struct chain_socket* region_at(int y, int x)
+{
+    struct region_cell *cell;
+    int i;
+    
+    if(!region_count)
+        return 0;
+    
+    if(y >= 0 && x >= 0 && y < REGION_CELLS*REGION_CELL && x < REGION_CELLS*REGION_CELL)
+    {
+        cell = &region_cells[y/REGION_CELL][x/REGION_CELL];
+        if(!cell->cs || cell->whole)
+            return cell->cs;
     }
     
+    for(i=0; i<region_count; i++)
+        if(region_contains(regions[i], y, x))
+            return regions[i];
+    
     return 0;
 }
 
-struct chain_socket* find_client(int *pos, pid_t pid)
+void unregion_client(struct chain_socket *cs)
 {
-    struct chain_socket *cs = client_list.cqh_first;
     int i;
     
-    if(pid)
+    for(i=0; i<region_count && regions[i] != cs; i++);
+    if(i == region_count)
+        return;
+    
+    memmove(&regions[i], &regions[i+1], (--region_count-i)*sizeof(struct chain_socket*));
+    region_build();
+}
+
+int find_topic(const char *name)
+{
+    int t;
+    
+    for(t=0; t<TOPIC_MAX; t++)
+        if(topics[t].subscribers && !strcmp(topics[t].name, name))
+            return t;
+    
+    return -1;
+}
+
+void untopic_client(struct chain_socket *cs, int t)
+{
+    cs->topics &= ~(1u<<t);
+    topics[t].subscribers--;
+}
+
+void unref_message(int m)
+{
+    if(--messages[m].refs || messages[m].fd == -1)
+        return;
+    
+    close(messages[m].fd);
+    messages[m].fd = -1;
+}
+
+// release the messages of count queued events from first
+void drop_messages(struct chain_socket *cs, int first, int count)
+{
+    for(; count--; first = (first+1) % backlog)
+        if(cs->queue[first].event == IOD_EVENT_MESSAGE)
+            unref_message(cs->queue[first].value.status);
+}
+
+struct chain_socket* add_client(int fd)
+{
+    struct chain_socket *cs = calloc(1, sizeof(struct chain_socket));
+    cs->sock = fd;
+    cs->version = 1;
+    cs->classes = IOD_CLASS_DEFAULT;
+    cs->queue = malloc(backlog*sizeof(struct iod_tevent));
+    if(watch_fd(fd, cs))
     {
-        while(cs != (void*)&client_list && cs->pid != pid)
-            cs = cs->chain.cqe_next;
-        if(cs == (void*)&client_list)
-            return 0;
+        free(cs->queue);
+        free(cs);
+        return 0;
+    }
+    stack_insert(cs);
+    LIST_INSERT_HEAD(&powersave_list, cs, powersave);
+    DEBUG(printf("Client added [%i]\n", fd));
+    return cs;
+}
+
+void unring_client(struct chain_socket *cs)
+{
+    if(!cs->ring)
+        return;
+    
+    // client keeps its own mapping and doorbell
+    munmap(cs->ring, sizeof(struct iod_ring));
+    close(cs->ring_fd);
+    cs->ring = 0;
+}
+
+void free_client(struct chain_socket *cs)
+{
+    int t;
+    
+    for(t=0; t<TOPIC_MAX; t++)
+        if(cs->topics & 1u<<t)
+            untopic_client(cs, t);
+    while(cs->in_nfds)
+        close(cs->in_fds[--cs->in_nfds]);
+    drop_messages(cs, cs->qhead, cs->qcount);
+    if(cs->classes & IOD_CLASS_POWERSAVE)
+        LIST_REMOVE(cs, powersave);
+    if(cs->flushing)
+        LIST_REMOVE(cs, flush);
+    unregion_client(cs);
+    if(touch.target == cs)
+    {
+        touch.target = 0;
+        touch.orphan = 1;
+    }
+    unring_client(cs);
+    if(cs->sending)
+    {
+        // the kernel sends from the queue until the cancelled send
+        // completes, the socket stays open until then
+        epoll_ctl(epfd, EPOLL_CTL_DEL, cs->sock, 0);
+        iod_uring_cancel(&uring, cs);
+        close(cs->sock);
+        cs->sock = -1;
+        return;
+    }
+    // closing the socket drops it from the epoll set
+    close(cs->sock);
+    free(cs->queue);
+    free(cs);
+}
+
+void poll_client_out(struct chain_socket *cs, int pollout)
+{
+    struct epoll_event ev;
+    
+    if(cs->pollout == pollout)
+        return;
+    
+    ev.events = pollout ? EPOLLIN|EPOLLOUT : EPOLLIN;
+    ev.data.ptr = cs;
+    
+    if(epoll_ctl(epfd, EPOLL_CTL_MOD, cs->sock, &ev) == -1)
+        DEBUG(perror("Failed to modify client poll"));
+    else
+        cs->pollout = pollout;
+}
+
+int pack_events(struct chain_socket *cs, struct msghdr *msg, struct iod_frame *frame,
+    struct iod_tevent *events, int count, int skip)
+{
+    struct iovec *iov = msg->msg_iov;
+    struct message_entry *m;
+    struct cmsghdr *cmsg;
+    int i, size = 0;
+    
+    msg->msg_iovlen = 0;
+    msg->msg_control = 0;
+    msg->msg_controllen = 0;
+    
+    if(cs->version > 1 && !cs->qv1 && events->event == IOD_EVENT_MESSAGE)
+    {
+        // frame of its own, the event carries the publisher
+        m = &messages[events->value.status];
+        cs->mevent = *events;
+        cs->mevent.value.status = m->pid;
+        frame->size = sizeof(struct iod_tevent_message);
+        frame->count = 1;
+        iov[msg->msg_iovlen].iov_base = frame;
+        iov[msg->msg_iovlen++].iov_len = sizeof(struct iod_frame);
+        iov[msg->msg_iovlen].iov_base = &cs->mevent;
+        iov[msg->msg_iovlen++].iov_len = sizeof(struct iod_tevent);
+        iov[msg->msg_iovlen].iov_base = &m->message;
+        iov[msg->msg_iovlen++].iov_len = sizeof(struct iod_message);
         
-        for(i=0; i<client_count; i++)
-            if(pfds[i+4].fd == cs->sock)
-                break;
-        *pos = i;
+        // the fd goes along with the first byte
+        if(m->fd != -1 && !skip)
+        {
+            msg->msg_control = cs->cbuf;
+            msg->msg_controllen = sizeof(cs->cbuf);
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            *(int*)CMSG_DATA(cmsg) = m->fd;
+        }
+    }
+    else if(cs->version > 1 && !cs->qv1)
+    {
+        frame->size = count*sizeof(struct iod_tevent);
+        frame->count = count;
+        iov[msg->msg_iovlen].iov_base = frame;
+        iov[msg->msg_iovlen++].iov_len = sizeof(struct iod_frame);
+        iov[msg->msg_iovlen].iov_base = events;
+        iov[msg->msg_iovlen++].iov_len = frame->size;
     }
     else
+        // v1 events are the head of the records
+        for(i=0; i<count; i++)
+        {
+            iov[msg->msg_iovlen].iov_base = &events[i];
+            iov[msg->msg_iovlen++].iov_len = sizeof(struct iod_event);
+        }
+    
+    // drop what was sent already
+    for(i=0; i<msg->msg_iovlen; i++)
     {
-        while(cs != (void*)&client_list && cs->sock != pfds[*pos].fd)
-            cs = cs->chain.cqe_next;
-        if(cs == (void*)&client_list)
-            return 0;
+        if(skip >= iov[i].iov_len)
+        {
+            skip -= iov[i].iov_len;
+            iov[i].iov_len = 0;
+        }
+        else
+        {
+            iov[i].iov_base = (char*)iov[i].iov_base + skip;
+            iov[i].iov_len -= skip;
+            size += iov[i].iov_len;
+            skip = 0;
+        }
+    }
+    
+    return size;
+}
+
+void add_latency(struct iod_hist *hist, struct iod_tevent *events, int count)
+{
+    long long now = iod_hist_now();
+    
+    while(count--)
+        iod_hist_add(hist, iod_hist_since(&events++->time, now));
+}
+
+// contiguous part of the ring in one frame
+void frame_client(struct chain_socket *cs)
+{
+    int i;
+    
+    cs->qframe = cs->qhead+cs->qcount > backlog ? backlog-cs->qhead : cs->qcount;
+    if(cs->qframe > FRAME_EVENTS)
+        cs->qframe = FRAME_EVENTS;
+    if(cs->qv1 && cs->qframe > cs->qv1)
+        cs->qframe = cs->qv1;
+    
+    // messages have a record size of their own
+    for(i=0; i<cs->qframe; i++)
+        if(cs->queue[cs->qhead+i].event == IOD_EVENT_MESSAGE)
+        {
+            cs->qframe = i ? i : 1;
+            break;
+        }
+    
+    cs->qsent = 0;
+}
+
+// count of size bytes sent, the frame is done once all are sent
+void sent_client(struct chain_socket *cs, int count, int size)
+{
+    cs->qsent += count;
+    if(count < size)
+        return;
+    
+    add_latency(&cs->latency, &cs->queue[cs->qhead], cs->qframe);
+    drop_messages(cs, cs->qhead, cs->qframe);
+    
+    cs->qhead = (cs->qhead+cs->qframe) % backlog;
+    cs->qcount -= cs->qframe;
+    if(cs->qv1)
+        cs->qv1 -= cs->qframe;
+    cs->sent += cs->qframe;
+    cs->qframe = 0;
+}
+
+void lost_client(struct chain_socket *cs)
+{
+    DEBUG(perror("Failed to send client event"));
+    // client gone, hangup removes it
+    drop_messages(cs, cs->qhead, cs->qcount);
+    cs->qcount = cs->qframe = cs->qv1 = 0;
+    poll_client_out(cs, 0);
+}
+
+int flush_client(struct chain_socket *cs)
+{
+    struct iovec iov[FRAME_EVENTS+1];
+    struct msghdr msg = { .msg_iov = iov };
+    struct iod_frame frame;
+    int count, size;
+    
+    // sent in one batch before the loop sleeps again
+    if(uring_loop)
+    {
+        if(!cs->flushing && !cs->sending && cs->qcount)
+        {
+            LIST_INSERT_HEAD(&flush_list, cs, flush);
+            cs->flushing = 1;
+        }
+        return 0;
+    }
+    
+    while(cs->qcount)
+    {
+        if(!cs->qframe)
+            frame_client(cs);
+        
+        size = pack_events(cs, &msg, &frame, &cs->queue[cs->qhead],
+            cs->qframe, cs->qsent);
+        
+        if((count = sendmsg(cs->sock, &msg, MSG_NOSIGNAL)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            lost_client(cs);
+            return -1;
+        }
+        
+        sent_client(cs, count, size);
+    }
+    
+    poll_client_out(cs, cs->qcount > 0);
+    
+    return 0;
+}
+
+void ring_doorbell(struct chain_socket *cs)
+{
+    eventfd_write(cs->ring_fd, 1);
+    cs->doorbells++;
+}
+
+void set_time(struct iod_time *to, const struct timeval *time)
+{
+    to->sec = time ? time->tv_sec : 0;
+    to->usec = time ? time->tv_usec : 0;
+}
+
+int send_ring(struct chain_socket *cs, unsigned char event, union iod_value value,
+    const struct timeval *time)
+{
+    struct iod_tevent evnt;
+    int ret;
+    
+    evnt.event = event;
+    evnt.value = value;
+    set_time(&evnt.time, time);
+    
+    if((ret = iod_ring_push(cs->ring, &evnt)) == -1)
+    {
+        DEBUG(printf("Client ring full, fallback to socket [%i] %i\n",
+            cs->sock, cs->pid));
+        iod_ring_close(cs->ring);
+        ring_doorbell(cs);
+        unring_client(cs);
+        return -1;
+    }
+    
+    if(ret)
+        ring_doorbell(cs);
+    cs->sent++;
+    add_latency(&cs->latency, &evnt, 1);
+    
+    return 0;
+}
+
+int event_class(unsigned char event)
+{
+    switch(event)
+    {
+    case IOD_EVENT_PRESSED:
+    case IOD_EVENT_RELEASED:
+        return IOD_CLASS_TOUCH;
+    case IOD_EVENT_MOVED:
+        return IOD_CLASS_MOVED;
+    case IOD_EVENT_GESTURE:
+        return IOD_CLASS_GESTURE;
+    case IOD_EVENT_AUX:
+        return IOD_CLASS_AUX;
+    case IOD_EVENT_POWER:
+        return IOD_CLASS_POWER;
+    case IOD_EVENT_ACTIVATED:
+    case IOD_EVENT_DEACTIVATED:
+    case IOD_EVENT_REMOVED:
+    case IOD_EVENT_PREACTIVATE:
+        return IOD_CLASS_LIFECYCLE;
+    case IOD_EVENT_POWERSAVE:
+        return IOD_CLASS_POWERSAVE;
+    case IOD_EVENT_LOCK:
+    case IOD_EVENT_GRAB:
+        return IOD_CLASS_LOCK;
+    default:
+        // protocol events like HELLO and RING are always sent
+        return IOD_CLASS_ALL;
+    }
+}
+
+// a queued message takes over a reference
+int queue_client(struct chain_socket *cs, unsigned char event, union iod_value value,
+    const struct timeval *time)
+{
+    struct iod_tevent *evnt;
+    
+    if(cs->qcount == backlog)
+    {
+        DEBUG(printf("Client backlog exceeded [%i] %i\n", cs->sock, cs->pid));
+        // hangup on next wakeup removes the client
+        cs->dead = 1;
+        cs->dropped += cs->qcount + 1;
+        drop_messages(cs, cs->qhead, cs->qcount);
+        if(event == IOD_EVENT_MESSAGE)
+            unref_message(value.status);
+        cs->qcount = cs->qframe = cs->qv1 = 0;
+        shutdown(cs->sock, SHUT_RDWR);
+        return -1;
+    }
+    
+    evnt = &cs->queue[(cs->qhead+cs->qcount) % backlog];
+    evnt->event = event;
+    evnt->value = value;
+    set_time(&evnt->time, time);
+    
+    if(++cs->qcount > cs->qmax)
+        cs->qmax = cs->qcount;
+    
+    // queue was empty, else wait for writable
+    if(cs->qcount == 1)
+        return flush_client(cs);
+    
+    return 0;
+}
+
+int send_client(unsigned char event, union iod_value value,
+    const struct timeval *time, struct chain_socket *cs)
+{
+    struct iod_tevent *evnt;
+    
+    if(!cs && !(cs = active))
+        return 0;
+    
+    if(cs->dead)
+    {
+        cs->dropped++;
+        return -1;
+    }
+    
+    if(!(cs->classes & event_class(event)))
+    {
+        cs->unsubscribed++;
+        return 0;
+    }
+    
+    if(cs->ring && !send_ring(cs, event, value, time))
+        return 0;
+    
+    // merge into pending MOVED unless in the frame being sent
+    if(event == IOD_EVENT_MOVED && cs->qcount > cs->qframe)
+    {
+        evnt = &cs->queue[(cs->qhead+cs->qcount-1) % backlog];
+        if(evnt->event == IOD_EVENT_MOVED)
+        {
+            evnt->value = value;
+            set_time(&evnt->time, time);
+            cs->coalesced++;
+            return 0;
+        }
+    }
+    
+    return queue_client(cs, event, value, time);
+}
+
+void send_client_cord(unsigned char event, short int y, short int x,
+    const struct timeval *time, struct chain_socket *cs)
+{
+    union iod_value value;
+    
+    value.cord.y = y;
+    value.cord.x = x;
+    
+    send_client(event, value, time, cs);
+}
+
+void send_client_button(unsigned char event, int status,
+    const struct timeval *time, struct chain_socket *cs)
+{
+    union iod_value value;
+    
+    value.status = status;
+    
+    send_client(event, value, time, cs);
+}
+
+void send_client_status(unsigned char event, int status, struct chain_socket *cs)
+{
+    send_client_button(event, status, 0, cs);
+}
+
+void ring_client(struct chain_socket *cs)
+{
+    struct iod_tevent evnt = { .event = IOD_EVENT_RING };
+    char name[32], cbuf[CMSG_SPACE(2*sizeof(int))];
+    struct iovec iov[2];
+    struct msghdr msg = { .msg_iov = iov };
+    struct iod_frame frame;
+    struct cmsghdr *cmsg;
+    int fd, count, size;
+    
+    // fds have to be sent in order with the pending events, the io_uring
+    // loop has them in flight after every send and retries when done
+    if(cs->ring || cs->qcount)
+    {
+        cs->ring_later = uring_loop && !cs->ring;
+        return;
+    }
+    cs->ring_later = 0;
+    
+    sprintf(name, "/%s.%i.%i", IOD_NAME, getpid(), cs->sock);
+    if((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) == -1)
+    {
+        DEBUG(perror("Failed to open ring shared memory"));
+        return;
+    }
+    shm_unlink(name);
+    
+    if(ftruncate(fd, sizeof(struct iod_ring)) == -1)
+    {
+        DEBUG(perror("Failed to truncate ring shared memory"));
+        close(fd);
+        return;
+    }
+    
+    if((cs->ring = mmap(0, sizeof(struct iod_ring), PROT_READ|PROT_WRITE,
+        MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        DEBUG(perror("Failed to mmap ring"));
+        cs->ring = 0;
+        close(fd);
+        return;
+    }
+    
+    if((cs->ring_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+    {
+        DEBUG(perror("Failed to open ring doorbell"));
+        munmap(cs->ring, sizeof(struct iod_ring));
+        cs->ring = 0;
+        close(fd);
+        return;
+    }
+    
+    size = pack_events(cs, &msg, &frame, &evnt, 1, 0);
+    
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2*sizeof(int));
+    ((int*)CMSG_DATA(cmsg))[0] = fd;
+    ((int*)CMSG_DATA(cmsg))[1] = cs->ring_fd;
+    
+    while((count = sendmsg(cs->sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+    close(fd);
+    
+    if(count == -1)
+    {
+        DEBUG(perror("Failed to send ring"));
+        unring_client(cs);
+        return;
+    }
+    
+    // remainder of the ring event goes through the socket queue
+    if(count < size)
+    {
+        cs->queue[cs->qhead] = evnt;
+        cs->qcount = cs->qframe = 1;
+        cs->qsent = count;
+        flush_client(cs);
+    }
+    else
+        cs->sent++;
+    
+    DEBUG(printf("Client ring [%i] %i\n", cs->sock, cs->pid));
+}
+
+// submit a send for every client flushed since the last wakeup
+void submit_clients()
+{
+    struct chain_socket *cs;
+    
+    while((cs = LIST_FIRST(&flush_list)))
+    {
+        LIST_REMOVE(cs, flush);
+        cs->flushing = 0;
+        if(!cs->qcount)
+            continue;
+        
+        if(!cs->qframe)
+            frame_client(cs);
+        
+        cs->msg.msg_iov = cs->iov;
+        cs->msize = pack_events(cs, &cs->msg, &cs->frame, &cs->queue[cs->qhead],
+            cs->qframe, cs->qsent);
+        
+        if(iod_uring_sendmsg(&uring, cs->sock, &cs->msg, MSG_NOSIGNAL, cs))
+            // submission queue is full, retried on EPOLLOUT
+            poll_client_out(cs, 1);
+        else
+            cs->sending = 1;
+    }
+}
+
+// completion of the send of a client
+void sent_uring(struct chain_socket *cs, int res)
+{
+    cs->sending = 0;
+    
+    // freed while the send was in flight
+    if(cs->sock == -1)
+    {
+        free(cs->queue);
+        free(cs);
+        return;
+    }
+    
+    if(res == -EAGAIN || res == -EWOULDBLOCK)
+    {
+        poll_client_out(cs, 1);
+        return;
+    }
+    if(res < 0 && res != -EINTR)
+    {
+        errno = -res;
+        lost_client(cs);
+        return;
+    }
+    
+    // the frame was dropped with the backlog meanwhile
+    if(res > 0 && cs->qframe)
+        sent_client(cs, res, cs->msize);
+    
+    poll_client_out(cs, 0);
+    if(cs->ring_later && !cs->qcount)
+        ring_client(cs);
+    flush_client(cs);
+}
+
+int recv_client(struct chain_socket *cs)
+{
+    char cbuf[CMSG_SPACE(CMD_FDS*sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int count, i;
+    
+    // keep unhandled bytes at the start
+    if(cs->in_pos)
+    {
+        memmove(cs->in, cs->in+cs->in_pos, cs->in_size-cs->in_pos);
+        cs->in_size -= cs->in_pos;
+        cs->in_pos = 0;
+    }
+    
+    iov.iov_base = cs->in+cs->in_size;
+    iov.iov_len = sizeof(cs->in)-cs->in_size;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    
+    while((count = recvmsg(cs->sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+    
+    // shared memory of messages, kept until published
+    for(cmsg = count > 0 ? CMSG_FIRSTHDR(&msg) : 0; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            for(i=0; i<(cmsg->cmsg_len-CMSG_LEN(0))/sizeof(int); i++)
+            {
+                if(cs->in_nfds < CMD_FDS)
+                    cs->in_fds[cs->in_nfds++] = ((int*)CMSG_DATA(cmsg))[i];
+                else
+                    close(((int*)CMSG_DATA(cmsg))[i]);
+            }
+    
+    if(count <= 0)
+    {
+        if(count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -1;
+        DEBUG(perror("Failed to recv client cmd"));
+        return -1;
+    }
+    
+    cs->in_size += count;
+    
+    return 0;
+}
+
+// command with the appended fields known to iod, zero if not sent,
+// returns -1 if incomplete, -2 on broken frame
+int next_cmd(struct chain_socket *cs, struct client_cmd *cmd)
+{
+    struct iod_frame frame;
+    int avail = cs->in_size-cs->in_pos;
+    
+    memset(cmd, 0, sizeof(*cmd));
+    
+    if(cs->version > 1 && !cs->in_left)
+    {
+        if(avail < sizeof(struct iod_frame))
+            return -1;
+        memcpy(&frame, cs->in+cs->in_pos, sizeof(struct iod_frame));
+        if(!frame.count || frame.size % frame.count
+            || frame.size/frame.count < sizeof(struct iod_cmd)
+            || frame.size/frame.count > sizeof(cs->in)/2)
+        {
+            return -2;
+        }
+        cs->in_pos += sizeof(struct iod_frame);
+        cs->in_left = frame.count;
+        cs->in_rsize = frame.size/frame.count;
+        avail -= sizeof(struct iod_frame);
+    }
+    
+    if(cs->version > 1)
+    {
+        if(avail < cs->in_rsize)
+            return -1;
+        // unknown trailing fields are skipped
+        memcpy(cmd, cs->in+cs->in_pos, cs->in_rsize < sizeof(*cmd) ? cs->in_rsize : sizeof(*cmd));
+        cs->in_pos += cs->in_rsize;
+        cs->in_left--;
+    }
+    else
+    {
+        if(avail < sizeof(struct iod_cmd))
+            return -1;
+        memcpy(&cmd->cmd, cs->in+cs->in_pos, sizeof(struct iod_cmd));
+        cs->in_pos += sizeof(struct iod_cmd);
+    }
+    
+    return 0;
+}
+
+struct pid_bucket* pid_bucket(pid_t pid)
+{
+    return &pid_hash[pid & (PID_HASH_SIZE-1)];
+}
+
+struct chain_socket* find_client(pid_t pid)
+{
+    struct chain_socket *cs;
+    
+    for(cs = pid_bucket(pid)->lh_first; cs; cs = cs->hash.le_next)
+        if(cs->pid == pid)
+            return cs;
+    
+    return 0;
+}
+
+// activate first visible app from active or hidden app with top priority
+struct chain_socket* stack_select()
+{
+    struct chain_socket *cs;
+    
+    if(active && active->hide)
+    {
+        if(!(cs = stack_next_visible(active, +1)))
+            cs = stack_hidden_top(0, 0);
+        active = cs;
+    }
+    
+    return active;
+}
+
+int rem_client(struct chain_socket *cs)
+{
+    int was_active = cs == active;
+    DEBUG(int fd = cs->sock);
+    DEBUG(pid_t pid = cs->pid);
+    
+    stack_remove(cs);
+    if(cs->pid)
+        LIST_REMOVE(cs, hash);
+    free_client(cs);
+    
+    if(active)
+    {
+        if(was_active)
+        {
+            if((cs = stack_select())->hide)
+                DEBUG(printf("Active client removed [%i] %i, switch invisible [%i] %i\n",
+                    fd, pid, cs->sock, cs->pid));
+            else
+                DEBUG(printf("Active client removed [%i] %i, switch [%i] %i\n",
+                    fd, pid, cs->sock, cs->pid));
+            return 1;
+        }
+        else
+        {
+            DEBUG(printf("Client removed [%i] %i\n", fd, pid));
+            return 0;
+        }
+    }
+    else
+    {
+        DEBUG(printf("Active client removed [%i] %i, last\n", fd, pid));
+        return 0;
+    }
+}
+
+int switch_client(int cmd, struct chain_socket *sender, pid_t pid)
+{
+    struct chain_socket *cs = 0;
+    int dir = +1;
+    
+    if(!active || active->next == active)
+        return 0;
+    
+    switch(cmd)
+    {
+    case IOD_SWITCH_PID:
+        cs = pid ? find_client(pid) : sender;
+        break;
+    case IOD_SWITCH_PREV:
+        dir = -1;
+    case IOD_SWITCH_NEXT:
+        cs = stack_next_visible(active, dir);
+        break;
+    case IOD_SWITCH_HIDDEN:
+        cs = stack_hidden_top(0, 0);
+        break;
+    }
+    
+    if(!cs || cs == active)
+        return 0;
+    
+    active = cs;
+    
+    DEBUG(printf("Client switch [%i] %i\n", active->sock, active->pid));
+    
+    return 1;
+}
+
+void register_client(struct chain_socket *cs, pid_t pid)
+{
+    if(cs->pid)
+        LIST_REMOVE(cs, hash);
+    
+    if((cs->pid = pid))
+        LIST_INSERT_HEAD(pid_bucket(pid), cs, hash);
+    
+    DEBUG(printf("Client registered [%i] %i\n", cs->sock, pid));
+}
+
+void hide_client(struct chain_socket *cs, pid_t pid, int priority, int hide)
+{
+    if(pid && !(cs = find_client(pid)))
+        return;
+    
+    stack_hide(cs, priority, hide);
+    
+    DEBUG(printf("Client set %s (%i) [%i] %i\n",
+        hide ? "invisible" : "visible", priority, cs->sock, cs->pid));
+}
+
+void free_clients()
+{
+    struct chain_socket *cs;
+    while((cs = active))
+    {
+        stack_remove(cs);
+        free_client(cs);
+    }
+    free(hidden);
+    hidden = 0;
+    hidden_count = hidden_size = 0;
+    free(regions);
+    regions = 0;
+    region_count = region_size = 0;
+}
+
+void cleanup()
+{
+    DEBUG(printf("cleanup\n"));
+    if(screen_fd)
+        close(screen_fd);
+    if(aux_fd)
+        close(aux_fd);
+    if(power_fd)
+        close(power_fd);
+    if(sock)
+        close(sock);
+    if(stats_sock)
+        close(stats_sock);
+    if(gesture_fd)
+        close(gesture_fd);
+    if(switch_fd)
+        close(switch_fd);
+    if(input_efd)
+        close(input_efd);
+    if(input_epfd)
+        close(input_epfd);
+    if(epfd)
+        close(epfd);
+    iod_uring_free(&uring);
+    free(screen_dev);
+    free(aux_dev);
+    free(power_dev);
+    free_clients();
+    if(trace)
+        fclose(trace);
+}
+
+void signal_handler(int signal)
+{
+    switch(signal)
+    {
+    case SIGUSR1:
+        dump_stats = 1;
+        break;
+    default:
+        cleanup();
+        exit(0);
+    }
+}
+
+void print_stats(FILE *file, const char *name, struct input_stats *stats)
+{
+    char buf[32];
+    
+    fprintf(file, "%s: %lu reads, %lu events, %lu frames, %lu merged, %lu filtered, %lu gestures, %lu resyncs\n",
+        name, __atomic_load_n(&stats->reads, __ATOMIC_RELAXED), stats->events,
+        stats->frames, stats->merged, stats->filtered, stats->gestures,
+        __atomic_load_n(&stats->resyncs, __ATOMIC_RELAXED));
+    sprintf(buf, "%s latency", name);
+    iod_hist_print(file, buf, &stats->latency);
+}
+
+void print_client_stats(FILE *file)
+{
+    struct chain_socket *cs;
+    
+    FOREACH_CLIENT(cs)
+    {
+        fprintf(file, "Client [%i] %i v%i%s%s: queue %i/%i (max %i), %lu sent, %lu coalesced, %lu dropped, %lu unsubscribed, %lu late",
+            cs->sock, cs->pid, cs->version, cs == active ? " active" : "",
+            cs->hide ? " hidden" : "", cs->qcount, backlog, cs->qmax,
+            cs->sent, cs->coalesced, cs->dropped, cs->unsubscribed, cs->late);
+        if(cs->ring)
+            fprintf(file, ", ring %u/%i, %lu doorbells",
+                cs->ring->head - cs->ring->tail, IOD_RING_SIZE, cs->doorbells);
+        if(cs->region.height)
+            fprintf(file, ", region (%i,%i) %ix%i z %i", cs->region.y, cs->region.x,
+                cs->region.height, cs->region.width, cs->z);
+        if(cs->topics)
+            fprintf(file, ", %i topics", __builtin_popcount(cs->topics));
+        fprintf(file, "\n");
+        iod_hist_print(file, "  latency", &cs->latency);
+    }
+}
+
+void print_bus_stats(FILE *file)
+{
+    int i, pending = 0;
+    
+    for(i=0; i<MESSAGE_POOL; i++)
+        pending += messages[i].refs > 0;
+    
+    fprintf(file, "Bus: %lu published, %lu dropped, %i/%i pending", published,
+        messages_dropped, pending, MESSAGE_POOL);
+    for(i=0; i<TOPIC_MAX; i++)
+        if(topics[i].subscribers)
+            fprintf(file, ", %s %i", topics[i].name, topics[i].subscribers);
+    fprintf(file, "\n");
+}
+
+void print_holder(FILE *file, const char *name, struct chain_socket *cs)
+{
+    if(cs)
+        fprintf(file, ", %s [%i] %i", name, cs->sock, cs->pid);
+    else
+        fprintf(file, ", %s none", name);
+}
+
+void print_all_stats(FILE *file)
+{
+    struct chain_socket *cs, *locker = 0;
+    long long now = iod_hist_now();
+    int clients = 0;
+    
+    FOREACH_CLIENT(cs)
+    {
+        clients++;
+        if(cs->lock)
+            locker = cs;
+    }
+    
+    fprintf(file, "iod: up %llis, %i clients, %lu wakeups (%lli/s)",
+        (now - start_time)/1000000, clients, wakeups,
+        now > stats_time ? (wakeups - stats_wakeups)*1000000LL/(now - stats_time) : 0);
+    if(realtime)
+        fprintf(file, ", realtime %i", realtime);
+    if(uring_loop)
+        fprintf(file, ", io_uring");
+    print_holder(file, "lock", locker);
+    print_holder(file, "aux grab", aux_grabber);
+    print_holder(file, "power grab", power_grabber);
+    fprintf(file, "\n");
+    
+    print_stats(file, "Screen", &screen_stats);
+    print_stats(file, "AUX", &aux_stats);
+    print_stats(file, "Power", &power_stats);
+    // head and input_full are written by the reader thread
+    if(threaded)
+        fprintf(file, "Input ring: %u/%i, %lu full\n",
+            __atomic_load_n(&input_ring.head, __ATOMIC_RELAXED) - input_ring.tail,
+            INPUT_RING, __atomic_load_n(&input_full, __ATOMIC_RELAXED));
+    fprintf(file, "Switch: deadline %i ms, %lu forced%s\n", switch_deadline,
+        switches_forced, switching ? ", pending" : "");
+    iod_hist_print(file, "Switch latency", &switch_latency);
+    if(stats_truncated)
+        fprintf(file, "Stats: %lu truncated\n", stats_truncated);
+    if(published)
+        print_bus_stats(file);
+    print_client_stats(file);
+    
+    // wakeup rate is per snapshot interval
+    stats_time = now;
+    stats_wakeups = wakeups;
+}
+
+void send_stats()
+{
+    struct timeval tv = { 0, STATS_TIMEOUT*1000 };
+    char *buf = 0;
+    size_t size = 0, pos = 0;
+    long long end = iod_hist_now() + STATS_TIMEOUT*1000;
+    ssize_t ret;
+    FILE *file;
+    int fd;
+    
+    if((fd = accept4(stats_sock, 0, 0, SOCK_CLOEXEC)) == -1)
+        return;
+    
+    // blocking, but a stalled reader costs at most STATS_TIMEOUT
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if((file = open_memstream(&buf, &size)))
+    {
+        print_all_stats(file);
+        fclose(file);
+        while(pos < size && iod_hist_now() < end)
+        {
+            if((ret = send(fd, buf+pos, size-pos, MSG_NOSIGNAL)) == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+                break;
+            }
+            pos += ret;
+        }
+        if(pos < size)
+        {
+            DEBUG(printf("Stats truncated at %zu of %zu bytes\n", pos, size));
+            stats_truncated++;
+        }
+        free(buf);
+    }
+    
+    close(fd);
+}
+
+int open_input(const char *dev)
+{
+    int fd;
+    
+    if((fd = open(dev, O_RDONLY)) == -1)
+        return -1;
+    
+    // never block on spurious wakeups
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL)|O_NONBLOCK);
+    
+    // input times comparable with clients, fails on sim fifos
+    ioctl(fd, EVIOCSCLOCKID, &(int){CLOCK_MONOTONIC});
+    
+    return fd;
+}
+
+int open_trace(const char *file)
+{
+    struct iod_trace_header header = { IOD_TRACE_MAGIC, IOD_TRACE_VERSION };
+    
+    if(!(trace = fopen(file, "w")))
+        return -1;
+    
+    if(fwrite(&header, sizeof(header), 1, trace) != 1)
+    {
+        fclose(trace);
+        trace = 0;
+        return -1;
+    }
+    
+    return 0;
+}
+
+void record_input(int device, int count, long long now)
+{
+    struct input_event *input;
+    struct iod_trace record;
+    
+    record.device = device;
+    for(input=inputs; input<inputs+count; input++)
+    {
+        if(input->time.tv_sec || input->time.tv_usec)
+            set_time(&record.time, &input->time);
+        else
+        {
+            record.time.sec = now/1000000;
+            record.time.usec = now%1000000;
+        }
+        record.type = input->type;
+        record.code = input->code;
+        record.value = input->value;
+        
+        // buffered, a failed write stops recording
+        if(fwrite(&record, sizeof(record), 1, trace) != 1)
+        {
+            DEBUG(perror("Failed to record input"));
+            fclose(trace);
+            trace = 0;
+            return;
+        }
+    }
+}
+
+// state of the device key and touch position after SYN_DROPPED
+int input_state(int fd, int device, struct input_event *state, const struct timeval *time)
+{
+    const int axes[] = { ABS_X, ABS_Y, ABS_PRESSURE };
+    struct input_sync *sync = &syncs[device];
+    struct input_absinfo abs;
+    unsigned char keys[KEY_MAX/8+1];
+    int count = 0, i, value;
+    
+    // fails on sim fifos, the frame is empty then
+    for(i=0; device == IOD_TRACE_SCREEN && i<3; i++)
+        if(ioctl(fd, EVIOCGABS(axes[i]), &abs) != -1)
+        {
+            state[count].type = EV_ABS;
+            state[count].code = axes[i];
+            state[count++].value = abs.value;
+        }
+    
+    // only a changed key, a repeated press would press twice
+    if(ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) != -1
+        && (value = !!(keys[sync->key/8] & 1<<sync->key%8)) != sync->value)
+    {
+        state[count].type = EV_KEY;
+        state[count].code = sync->key;
+        state[count++].value = sync->value = value;
+    }
+    
+    for(i=0; i<count; i++)
+        state[i].time = *time;
+    
+    return count;
+}
+
+// Events of frames broken by SYN_DROPPED are replaced by the device state
+// at the next SYN_REPORT. The state is read once for the last drop of the
+// batch. Events are read to buf+INPUT_SLACK and moved to buf, which leaves
+// room for the state in front of the first event not moved yet.
+int sync_input(int fd, int device, struct input_event *buf, int count, struct input_stats *stats)
+{
+    struct input_sync *sync = &syncs[device];
+    struct input_event *in, *out = buf, *end = buf+INPUT_SLACK+count, *last = 0;
+    
+    for(in=buf+INPUT_SLACK; in<end; in++)
+        if(in->type == EV_SYN && in->code == SYN_DROPPED)
+            last = in;
+    
+    for(in=buf+INPUT_SLACK; in<end; in++)
+    {
+        if(in->type == EV_SYN && in->code == SYN_DROPPED)
+        {
+            DEBUG(printf("SYN_DROPPED on device %i\n", device));
+            __atomic_add_fetch(&stats->resyncs, 1, __ATOMIC_RELAXED);
+            sync->dropped = 1;
+            continue;
+        }
+        if(sync->dropped)
+        {
+            if(in->type != EV_SYN || in->code != SYN_REPORT)
+                continue;
+            sync->dropped = 0;
+            if(in < last)
+                continue;
+            out += input_state(fd, device, out, &in->time);
+        }
+        else if(in->type == EV_KEY && in->code == sync->key)
+            sync->value = in->value;
+        *out++ = *in;
+    }
+    
+    return out-buf;
+}
+
+// one read for all pending events, evdev only returns whole input_events
+int read_device(int fd, int device, struct input_event *buf, struct input_stats *stats)
+{
+    int count;
+    
+    while((count = read(fd, buf+INPUT_SLACK, INPUT_BATCH*sizeof(struct input_event))) == -1
+        && errno == EINTR);
+    
+    if(count <= 0)
+        return 0;
+    
+    // the reader thread is the only writer of reads and resyncs
+    __atomic_add_fetch(&stats->reads, 1, __ATOMIC_RELAXED);
+    
+    return sync_input(fd, device, buf, count/sizeof(struct input_event), stats);
+}
+
+// stats, latency and trace of count events in inputs
+void account_input(int device, int count, struct input_stats *stats)
+{
+    struct input_event *input;
+    struct iod_time time;
+    long long now;
+    
+    stats->events += count;
+    
+    // frame latency at time of read, or of leaving the input ring
+    now = iod_hist_now();
+    for(input=inputs; input<inputs+count; input++)
+        if(input->type == EV_SYN && input->code == SYN_REPORT)
+        {
+            set_time(&time, &input->time);
+            iod_hist_add(&stats->latency, iod_hist_since(&time, now));
+        }
+    
+    if(trace)
+        record_input(device, count, now);
+}
+
+int read_input(int fd, int device, struct input_stats *stats)
+{
+    int count = read_device(fd, device, inputs, stats);
+    
+    account_input(device, count, stats);
+    
+    return count;
+}
+
+int client_behind(struct chain_socket *cs)
+{
+    int pending;
+    
+    if(!cs && !(cs = active))
+        return 0;
+    if(cs->qcount)
+        return 1;
+    if(cs->ring)
+        return !iod_ring_empty(cs->ring);
+    
+    // bytes not yet read by client
+    if(ioctl(cs->sock, SIOCOUTQ, &pending) == -1)
+        return 0;
+    
+    return pending > 0;
+}
+
+// touch events go to the region client of the sequence
+void send_touch(unsigned char event, short int y, short int x, const struct timeval *time)
+{
+    if(!touch.orphan)
+        send_client_cord(event, y, x, time, touch.target);
+}
+
+void flush_moved()
+{
+    if(!touch.moved)
+        return;
+    
+    send_touch(IOD_EVENT_MOVED, touch.my, touch.mx, &touch.mtime);
+    touch.moved = 0;
+}
+
+void queue_moved()
+{
+    if(touch.moved)
+        screen_stats.merged++;
+    else if(!client_behind(touch.target))
+    {
+        send_touch(IOD_EVENT_MOVED, touch.y, touch.x, &touch.time);
+        return;
+    }
+    
+    // hold back until end of batch, newer MOVED frames replace it
+    touch.moved = 1;
+    touch.my = touch.y;
+    touch.mx = touch.x;
+    touch.mtime = touch.time;
+}
+
+int filter_light()
+{
+    // resistive screens report garbage positions on light touches
+    if(!pressure_min || touch.pressure >= pressure_min)
+        return 0;
+    
+    screen_stats.filtered++;
+    return 1;
+}
+
+int filter_select(int *samples, int count)
+{
+    int sorted[FILTER_SAMPLES], i, j, sum = 0;
+    
+    if(!smooth_median)
+    {
+        for(i=0; i<count; i++)
+            sum += samples[i];
+        return sum/count;
+    }
+    
+    for(i=0; i<count; i++)
+    {
+        for(j=i; j>0 && sorted[j-1] > samples[i]; j--)
+            sorted[j] = sorted[j-1];
+        sorted[j] = samples[i];
+    }
+    
+    return sorted[count/2];
+}
+
+void filter_sample(int reset)
+{
+    if(smooth < 2)
+    {
+        touch.y = touch.ry;
+        touch.x = touch.rx;
+        return;
+    }
+    
+    if(reset)
+        touch.shead = touch.scount = 0;
+    
+    touch.sy[touch.shead] = touch.ry;
+    touch.sx[touch.shead] = touch.rx;
+    touch.shead = (touch.shead+1) % smooth;
+    if(touch.scount < smooth)
+        touch.scount++;
+    
+    touch.y = filter_select(touch.sy, touch.scount);
+    touch.x = filter_select(touch.sx, touch.scount);
+}
+
+int filter_dead()
+{
+    if(abs(touch.y-touch.ay) >= dead_zone || abs(touch.x-touch.ax) >= dead_zone)
+    {
+        touch.ay = touch.y;
+        touch.ax = touch.x;
+        return 0;
+    }
+    
+    screen_stats.filtered++;
+    return 1;
+}
+
+// frame time, read time for input without time
+int64_t touch_us()
+{
+    // realtime evdev stamps do not fit a 32 bit long in us
+    if(touch.time.tv_sec || touch.time.tv_usec)
+        return touch.time.tv_sec*(int64_t)1000000 + touch.time.tv_usec;
+    return iod_hist_now();
+}
+
+void set_timer(int fd, int ms)
+{
+    struct itimerspec its = { { 0, 0 }, { ms/1000, (ms%1000)*1000000L } };
+    
+    // 0 disarms
+    timerfd_settime(fd, 0, &its, 0);
+}
+
+int gesture_far(int y, int x, int y2, int x2, int pixels)
+{
+    return abs(y-y2) > pixels || abs(x-x2) > pixels;
+}
+
+void send_gesture(int type, int dir, int64_t speed, const struct timeval *time)
+{
+    // 16 bits in the status
+    if(speed > 0xffff)
+        speed = 0xffff;
+    
+    DEBUG(printf("Gesture %i direction %i speed %i\n", type, dir, (int)speed));
+    screen_stats.gestures++;
+    if(!touch.orphan)
+        send_client_button(IOD_EVENT_GESTURE, IOD_GESTURE(type, dir, (int)speed), time, touch.target);
+}
+
+void gesture_press(int y, int x)
+{
+    struct chain_socket *cs = touch.target ? touch.target : active;
+    
+    // only recognize for a client that wants gestures
+    if(!cs || !(cs->classes & IOD_CLASS_GESTURE))
+    {
+        gesture.state = 0;
+        return;
+    }
+    
+    gesture.state = 1;
+    gesture.y = y;
+    gesture.x = x;
+    gesture.time = touch_us();
+    set_timer(gesture_fd, GESTURE_LONG);
+}
+
+void gesture_move(int y, int x)
+{
+    if(gesture.state == 1 && gesture_far(y, x, gesture.y, gesture.x, GESTURE_SLOP))
+    {
+        gesture.state = 2;
+        set_timer(gesture_fd, 0);
+    }
+}
+
+void gesture_release(int y, int x)
+{
+    int64_t now = touch_us(), duration = now - gesture.time;
+    int dy = y - gesture.y, dx = x - gesture.x;
+    int dist = abs(dy) > abs(dx) ? abs(dy) : abs(dx);
+    
+    switch(gesture.state)
+    {
+    case 1:
+        set_timer(gesture_fd, 0);
+        // released before the timer was handled
+        if(duration >= GESTURE_LONG*1000L)
+        {
+            send_gesture(IOD_GESTURE_LONG, 0, 0, &touch.time);
+            break;
+        }
+        if(duration > GESTURE_TAP*1000L)
+            break;
+        send_gesture(IOD_GESTURE_TAP, 0, 0, &touch.time);
+        if(gesture.ttime && now - gesture.ttime <= GESTURE_DOUBLE*1000L
+            && !gesture_far(y, x, gesture.ty, gesture.tx, 2*GESTURE_SLOP))
+        {
+            send_gesture(IOD_GESTURE_DOUBLE, 0, 0, &touch.time);
+            gesture.ttime = 0;
+        }
+        else
+        {
+            gesture.ttime = now;
+            gesture.ty = y;
+            gesture.tx = x;
+        }
+        break;
+    case 2:
+        if(dist < GESTURE_SWIPE)
+            break;
+        send_gesture(IOD_GESTURE_SWIPE,
+            abs(dy) > abs(dx) ? (dy < 0 ? IOD_GESTURE_UP : IOD_GESTURE_DOWN)
+                : (dx < 0 ? IOD_GESTURE_LEFT : IOD_GESTURE_RIGHT),
+            dist*(int64_t)1000000/(duration > 0 ? duration : 1), &touch.time);
+        break;
+    }
+    
+    gesture.state = 0;
+}
+
+// long press timer
+void handle_gesture()
+{
+    uint64_t expired;
+    
+    if(read(gesture_fd, &expired, sizeof(expired)) != sizeof(expired))
+        return;
+    
+    if(gesture.state == 1)
+    {
+        send_gesture(IOD_GESTURE_LONG, 0, 0, 0);
+        gesture.state = 3;
+    }
+}
+
+void handle_screen(int count)
+{
+    struct input_event *input;
+    
+    if(lock)
+        return;
+    
+    for(input=inputs; input<inputs+count; input++)
+        switch(input->type)
+        {
+        case EV_KEY:
+            switch(input->code)
+            {
+            case BTN_TOUCH:
+                switch(input->value)
+                {
+                    case 0:
+                        touch.status = 0;
+                        break;
+                    case 1:
+                        touch.status = 1;
+                        break;
+                }
+                break;
+            }
+            break;
+        case EV_ABS:
+            switch(input->code)
+            {
+            case ABS_X:
+                touch.ry = input->value-MIN_PIXEL;
+                break;
+            case ABS_Y:
+                touch.rx = input->value-MIN_PIXEL;
+                break;
+            case ABS_PRESSURE:
+                touch.pressure = input->value;
+                break;
+            }
+            break;
+        case EV_SYN:
+            switch(input->code)
+            {
+            case SYN_REPORT:
+                screen_stats.frames++;
+                touch.time = input->time;
+                switch(touch.status)
+                {
+                case 0:
+                    flush_moved();
+                    // no release for touches too light to press
+                    if(!touch.pressed && pressure_min)
+                        break;
+                    if(smooth < 2)
+                        filter_sample(0);
+                    touch.pressed = 0;
+                    DEBUG(printf("Touchscreen released (%i,%i)\n", touch.y, touch.x));
+                    send_touch(IOD_EVENT_RELEASED, touch.y, touch.x, &touch.time);
+                    gesture_release(touch.y, touch.x);
+                    break;
+                case 1:
+                    if(filter_light())
+                        break;
+                    filter_sample(1);
+                    flush_moved();
+                    DEBUG(printf("Touchscreen pressed (%i,%i)\n", touch.y, touch.x));
+                    touch.target = region_at(touch.y, touch.x);
+                    touch.orphan = 0;
+                    send_touch(IOD_EVENT_PRESSED, touch.y, touch.x, &touch.time);
+                    gesture_press(touch.y, touch.x);
+                    touch.pressed = 1;
+                    touch.status = 2;
+                    touch.ay = touch.y;
+                    touch.ax = touch.x;
+                    break;
+                case 2:
+                    if(filter_light())
+                        break;
+                    filter_sample(0);
+                    if(dead_zone && filter_dead())
+                        break;
+                    gesture_move(touch.y, touch.x);
+                    queue_moved();
+                    break;
+                }
+                break;
+            }
+            break;
+        }
+    
+    flush_moved();
+}
+
+void handle_aux(int count)
+{
+    struct input_event *input;
+    
+    for(input=inputs; input<inputs+count; input++)
+        switch(input->type)
+        {
+        case EV_KEY:
+            switch(input->code)
+            {
+            case KEY_PHONE:
+                aux_pressed = input->value;
+                break;
+            }
+            break;
+        case EV_SYN:
+            switch(input->code)
+            {
+            case SYN_REPORT:
+                aux_stats.frames++;
+                DEBUG(printf("AUX %s\n",
+                    aux_pressed ? "pressed" : "released"));
+                send_client_button(IOD_EVENT_AUX, aux_pressed,
+                    &input->time, aux_grabber);
+                break;
+            }
+            break;
+        }
+}
+
+void handle_power(int count)
+{
+    struct input_event *input;
+    
+    for(input=inputs; input<inputs+count; input++)
+        switch(input->type)
+        {
+        case EV_KEY:
+            switch(input->code)
+            {
+            case KEY_POWER:
+                power_pressed = input->value;
+                break;
+            }
+            break;
+        case EV_PWR:
+            break;
+        case EV_SYN:
+            switch(input->code)
+            {
+            case SYN_REPORT:
+                power_stats.frames++;
+                DEBUG(printf("Power %s\n",
+                    power_pressed ? "pressed" : "released"));
+                send_client_button(IOD_EVENT_POWER, power_pressed,
+                    &input->time, power_grabber);
+                break;
+            }
+            break;
+        }
+}
+
+int reopen_input(int *fd, const char *dev)
+{
+    close(*fd);
+    
+    if((*fd = open_input(dev)) == -1)
+    {
+        *fd = 0;
+        return -1;
+    }
+    
+    // the io_uring loop posts the next read itself
+    return uring_loop ? 0 : watch_fd(*fd, fd);
+}
+
+void input_doorbell(unsigned int head)
+{
+    __atomic_store_n(&input_ring.head, head, __ATOMIC_RELEASE);
+    
+    // pairs with the fence in input_sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    if(__atomic_exchange_n(&input_ring.waiting, 0, __ATOMIC_ACQ_REL))
+        eventfd_write(input_efd, 1);
+}
+
+void push_inputs(int device, struct input_event *buf, int count)
+{
+    unsigned int head = input_ring.head;
+    struct input_entry *entry;
+    int i;
+    
+    for(i=0; i<count; i++)
+    {
+        // main loop is behind, the kernel buffers meanwhile
+        while(head - __atomic_load_n(&input_ring.tail, __ATOMIC_ACQUIRE) == INPUT_RING)
+        {
+            input_doorbell(head);
+            __atomic_add_fetch(&input_full, 1, __ATOMIC_RELAXED);
+            usleep(1000);
+        }
+        entry = &input_ring.entries[head++ & (INPUT_RING-1)];
+        entry->device = device;
+        entry->input = buf[i];
+    }
+    
+    input_doorbell(head);
+}
+
+// consecutive events of one device to inputs, returns 0 if empty
+int pop_inputs(int *device)
+{
+    unsigned int tail = input_ring.tail;
+    unsigned int head = __atomic_load_n(&input_ring.head, __ATOMIC_ACQUIRE);
+    int count = 0;
+    
+    if(head == tail)
+        return 0;
+    
+    *device = input_ring.entries[tail & (INPUT_RING-1)].device;
+    while(tail != head && count < INPUT_BATCH
+        && input_ring.entries[tail & (INPUT_RING-1)].device == *device)
+    {
+        inputs[count++] = input_ring.entries[tail++ & (INPUT_RING-1)].input;
+    }
+    __atomic_store_n(&input_ring.tail, tail, __ATOMIC_RELEASE);
+    
+    return count;
+}
+
+// announce sleep, returns -1 if events are pending and sleep is cancelled
+int input_sleep()
+{
+    __atomic_store_n(&input_ring.waiting, 1, __ATOMIC_RELEASE);
+    
+    // pairs with the fence in input_doorbell
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    if(__atomic_load_n(&input_ring.head, __ATOMIC_ACQUIRE) == input_ring.tail)
+        return 0;
+    
+    __atomic_store_n(&input_ring.waiting, 0, __ATOMIC_RELEASE);
+    return -1;
+}
+
+int watch_input(int device, int fd)
+{
+    struct epoll_event ev;
+    
+    ev.events = EPOLLIN;
+    ev.data.u32 = device;
+    
+    return epoll_ctl(input_epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// reader thread, keeps the kernel buffers drained while the main loop
+// sends to clients
+void* read_inputs(void *arg)
+{
+    int *fds[] = { &screen_fd, &aux_fd, &power_fd };
+    char **devs[] = { &screen_dev, &aux_dev, &power_dev };
+    struct input_stats *stats[] = { &screen_stats, &aux_stats, &power_stats };
+    const int errors[] = { 6, 8, 10 };
+    struct input_event buf[INPUT_BATCH+INPUT_SLACK];
+    struct epoll_event events[IOD_TRACE_DEVICES], *ev;
+    int count, size, device;
+    
+    while(1)
+    {
+        if((count = epoll_wait(input_epfd, events, IOD_TRACE_DEVICES, -1)) == -1)
+            continue;
+        
+        for(ev=events; ev<events+count; ev++)
+        {
+            device = ev->data.u32;
+            if(ev->events & (EPOLLHUP|EPOLLERR))
+            {
+                DEBUG(printf("pollhup/err on input %i\n", device));
+                close(*fds[device]);
+                if((*fds[device] = open_input(*devs[device])) == -1
+                    || watch_input(device, *fds[device]))
+                {
+                    // main loop exits on the doorbell
+                    perror("Failed to reopen input");
+                    *fds[device] = 0;
+                    input_error = errors[device];
+                    eventfd_write(input_efd, 1);
+                    return 0;
+                }
+            }
+            else if((size = read_device(*fds[device], device, buf, stats[device])))
+                push_inputs(device, buf, size);
+        }
+    }
+    
+    return 0;
+}
+
+int start_reader()
+{
+    int fds[] = { screen_fd, aux_fd, power_fd };
+    pthread_t thread;
+    sigset_t all, old;
+    int device, ret;
+    
+    if((input_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+    {
+        input_efd = 0;
+        return -1;
+    }
+    if((input_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        input_epfd = 0;
+        return -1;
+    }
+    for(device=0; device<IOD_TRACE_DEVICES; device++)
+        if(watch_input(device, fds[device]))
+            return -1;
+    
+    // main loop sleeps until the first doorbell
+    input_ring.waiting = 1;
+    
+    // signals are handled by the main loop only
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&thread, 0, read_inputs, 0);
+    pthread_sigmask(SIG_SETMASK, &old, 0);
+    
+    if(ret)
+    {
+        errno = ret;
+        return -1;
+    }
+    
+    pthread_detach(thread);
+    
+    return 0;
+}
+
+void handle_inputs()
+{
+    struct input_stats *stats[] = { &screen_stats, &aux_stats, &power_stats };
+    uint64_t value;
+    int count, device, batches;
+    
+    read(input_efd, &value, sizeof(value));
+    
+    for(batches=0; batches<INPUT_BUDGET; batches++)
+    {
+        if(!(count = pop_inputs(&device)))
+        {
+            if(!input_sleep())
+                return;
+            continue;
+        }
+        
+        account_input(device, count, stats[device]);
+        switch(device)
+        {
+        case IOD_TRACE_SCREEN:
+            handle_screen(count);
+            break;
+        case IOD_TRACE_AUX:
+            handle_aux(count);
+            break;
+        case IOD_TRACE_POWER:
+            handle_power(count);
+            break;
+        }
+    }
+    
+    // rest on the next wakeup, commands get their turn in between
+    eventfd_write(input_efd, 1);
+}
+
+void finish_switch()
+{
+    if(switch_start)
+    {
+        set_timer(switch_fd, 0);
+        iod_hist_add(&switch_latency, iod_hist_now() - switch_start);
+        switch_start = 0;
+    }
+    switching = 0;
+    send_client_status(IOD_EVENT_ACTIVATED, 0, 0);
+}
+
+void deactivate_client(struct chain_socket *cs)
+{
+    // without lifecycle events there is no ACK to wait for,
+    // a pending switch activates on its own ACK
+    if(!(cs->classes & IOD_CLASS_LIFECYCLE))
+    {
+        if(!switching)
+            finish_switch();
+        return;
+    }
+    
+    send_client_status(IOD_EVENT_DEACTIVATED, 0, cs);
+    
+    // a newer switch supersedes the pending one, latency counts from the first
+    if(!switch_start)
+        switch_start = iod_hist_now();
+    switching = cs;
+    set_timer(switch_fd, switch_deadline);
+    
+    // let the incoming app prepare while the outgoing one acks
+    send_client_status(IOD_EVENT_PREACTIVATE, 0, 0);
+}
+
+// switch deadline timer
+void handle_switch()
+{
+    uint64_t expired;
+    
+    if(read(switch_fd, &expired, sizeof(expired)) != sizeof(expired) || !switching)
+        return;
+    
+    DEBUG(printf("Client missed switch deadline [%i] %i -> [%i] %i\n",
+        switching->sock, switching->pid, active->sock, active->pid));
+    switching->late++;
+    switches_forced++;
+    finish_switch();
+}
+
+void subscribe_client(struct chain_socket *cs, int classes)
+{
+    if((cs->classes ^ classes) & IOD_CLASS_POWERSAVE)
+    {
+        if(classes & IOD_CLASS_POWERSAVE)
+            LIST_INSERT_HEAD(&powersave_list, cs, powersave);
+        else
+            LIST_REMOVE(cs, powersave);
+    }
+    
+    cs->classes = classes;
+    
+    DEBUG(printf("Client subscribed 0x%x [%i] %i\n", classes, cs->sock, cs->pid));
+}
+
+void region_client(struct chain_socket *cs, int z, struct iod_region *region)
+{
+    struct chain_socket **tmp;
+    int i;
+    
+    unregion_client(cs);
+    
+    cs->region = *region;
+    cs->z = z;
+    
+    if(region->height <= 0 || region->width <= 0)
+    {
+        memset(&cs->region, 0, sizeof(struct iod_region));
+        DEBUG(printf("Client region released [%i] %i\n", cs->sock, cs->pid));
+        return;
+    }
+    
+    if(region_count == region_size)
+    {
+        if(!(tmp = realloc(regions, (region_size+4)*sizeof(struct chain_socket*))))
+        {
+            perror("Failed to allocate region");
+            memset(&cs->region, 0, sizeof(struct iod_region));
+            return;
+        }
+        regions = tmp;
+        region_size += 4;
+    }
+    
+    // above older regions of same z order
+    for(i=0; i<region_count && regions[i]->z > z; i++);
+    memmove(&regions[i+1], &regions[i], (region_count-i)*sizeof(struct chain_socket*));
+    regions[i] = cs;
+    region_count++;
+    region_build();
+    
+    DEBUG(printf("Client region (%i,%i) %ix%i z %i [%i] %i\n", region->y, region->x,
+        region->height, region->width, z, cs->sock, cs->pid));
+}
+
+void topic_client(struct chain_socket *cs, int value, struct iod_message *message)
+{
+    int t;
+    
+    message->topic[IOD_TOPIC_SIZE-1] = 0;
+    
+    // v1 has no room for messages
+    if(cs->version < 2 || !message->topic[0])
+        return;
+    
+    t = find_topic(message->topic);
+    
+    if(!(value & IOD_TOPIC_SUBSCRIBE))
+    {
+        if(t != -1 && cs->topics & 1u<<t)
+            untopic_client(cs, t);
+        DEBUG(printf("Client unsubscribed topic %s [%i] %i\n", message->topic, cs->sock, cs->pid));
+        return;
+    }
+    
+    if(t == -1)
+    {
+        for(t=0; t<TOPIC_MAX && topics[t].subscribers; t++);
+        if(t == TOPIC_MAX)
+        {
+            DEBUG(printf("Too many topics, %s not subscribed [%i] %i\n",
+                message->topic, cs->sock, cs->pid));
+            return;
+        }
+        strcpy(topics[t].name, message->topic);
+    }
+    
+    if(!(cs->topics & 1u<<t))
+    {
+        cs->topics |= 1u<<t;
+        topics[t].subscribers++;
+    }
+    
+    DEBUG(printf("Client subscribed topic %s [%i] %i\n", message->topic, cs->sock, cs->pid));
+}
+
+void publish_client(struct chain_socket *cs, struct iod_message *message)
+{
+    struct chain_socket *cs2;
+    struct message_entry *m;
+    union iod_value value;
+    struct stat st;
+    int t, i, fd = -1;
+    
+    message->topic[IOD_TOPIC_SIZE-1] = 0;
+    
+    // shared memory fds are received in order with their commands
+    if(message->flags & IOD_MESSAGE_SHM)
+    {
+        if(!cs->in_nfds)
+        {
+            DEBUG(printf("Message without shared memory on %s [%i] %i\n",
+                message->topic, cs->sock, cs->pid));
+            messages_dropped++;
+            return;
+        }
+        fd = cs->in_fds[0];
+        memmove(cs->in_fds, cs->in_fds+1, --cs->in_nfds*sizeof(int));
+        // subscribers map the declared size, beyond the file they get SIGBUS
+        if(!message->size || fstat(fd, &st) == -1 || st.st_size < message->size)
+        {
+            DEBUG(printf("Message with %u bytes of shared memory invalid on %s [%i] %i\n",
+                message->size, message->topic, cs->sock, cs->pid));
+            close(fd);
+            messages_dropped++;
+            return;
+        }
+    }
+    else if(message->size > IOD_MESSAGE_SIZE)
+        message->size = IOD_MESSAGE_SIZE;
+    
+    published++;
+    
+    // nobody else listening
+    if((t = find_topic(message->topic)) == -1
+        || topics[t].subscribers == !!(cs->topics & 1u<<t))
+    {
+        if(fd != -1)
+            close(fd);
+        return;
+    }
+    
+    for(i=0; i<MESSAGE_POOL && messages[message_next].refs; i++)
+        message_next = (message_next+1) % MESSAGE_POOL;
+    if(i == MESSAGE_POOL)
+    {
+        DEBUG(printf("Message pool exhausted, dropping message on %s\n", message->topic));
+        messages_dropped++;
+        if(fd != -1)
+            close(fd);
+        return;
+    }
+    
+    m = &messages[message_next];
+    m->fd = fd;
+    m->pid = cs->pid;
+    m->message = *message;
+    value.status = message_next;
+    
+    // held until queued to all subscribers
+    m->refs = 1;
+    FOREACH_CLIENT(cs2)
+        if(cs2 != cs && cs2->topics & 1u<<t)
+        {
+            if(cs2->dead)
+            {
+                cs2->dropped++;
+                continue;
+            }
+            m->refs++;
+            queue_client(cs2, IOD_EVENT_MESSAGE, value, 0);
+        }
+    unref_message(message_next);
+    
+    DEBUG(printf("Client published on %s, %i bytes%s [%i] %i\n", message->topic,
+        message->size, fd != -1 ? " shared" : "", cs->sock, cs->pid));
+}
+
+void welcome_client(int client)
+{
+    struct chain_socket *cs, *cs2;
+    struct ucred cred;
+    socklen_t size = sizeof(struct ucred);
+    
+    cs = active;
+    if(!(cs2 = add_client(client)))
+    {
+        close(client);
+        return;
+    }
+    
+    // register peer right away, REGISTER is only needed by v1 clients
+    if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &size) != -1)
+        register_client(cs2, cred.pid);
+    
+    send_client_status(IOD_EVENT_HELLO, IOD_VERSION, cs2);
+    
+    if(cs)
+        deactivate_client(cs);
+    else
+        finish_switch();
+}
+
+void accept_client()
+{
+    int client;
+    
+    if((client = accept4(sock, 0, 0, SOCK_NONBLOCK)) == -1)
+    {
+        DEBUG(perror("Failed to accept client"));
+        return;
+    }
+    
+    welcome_client(client);
+}
+
+void remove_client(struct chain_socket *cs)
+{
+    // hangup of the deactivated app acks the switch
+    int acked = cs == switching;
+    
+    if(acked)
+        switching = 0;
+    if(cs == aux_grabber)
+    {
+        DEBUG(printf("AUX ungrabbed [%i] %i\n",
+            cs->sock, cs->pid));
+        aux_grabber = 0;
+    }
+    if(cs == power_grabber)
+    {
+        DEBUG(printf("Power ungrabbed [%i] %i\n",
+            cs->sock, cs->pid));
+        power_grabber = 0;
+    }
+    if(cs->lock)
+    {
+        DEBUG(printf("Screen unlocked [%i] %i\n",
+            cs->sock, cs->pid));
+        lock = 0;
+    }
+    if((rem_client(cs) || acked) && !switching)
+        finish_switch();
+}
+
+void grab_client(struct chain_socket *cs, int value)
+{
+    switch(value & ~IOD_GRAB_MASK)
+    {
+    case IOD_GRAB_AUX:
+        if(!aux_grabber || cs == aux_grabber)
+        {
+            if(value & IOD_GRAB_MASK)
+            {
+                DEBUG(printf("AUX grabbed [%i] %i\n",
+                    cs->sock, cs->pid));
+                aux_grabber = cs;
+            }
+            else
+            {
+                DEBUG(printf("AUX ungrabbed [%i] %i\n",
+                    cs->sock, cs->pid));
+                aux_grabber = 0;
+            }
+            send_client_status(IOD_EVENT_GRAB,
+                IOD_SUCCESS_MASK|IOD_GRAB_AUX, cs);
+        }
+        else
+            send_client_status(IOD_EVENT_GRAB,
+                IOD_GRAB_AUX, cs);
+        break;
+    case IOD_GRAB_POWER:
+        if(!power_grabber || cs == power_grabber)
+        {
+            if(value & IOD_GRAB_MASK)
+            {
+                DEBUG(printf("Power grabbed [%i] %i\n",
+                    cs->sock, cs->pid));
+                power_grabber = cs;
+            }
+            else
+            {
+                DEBUG(printf("Power ungrabbed [%i] %i\n",
+                    cs->sock, cs->pid));
+                power_grabber = 0;
+            }
+            send_client_status(IOD_EVENT_GRAB,
+                IOD_SUCCESS_MASK|IOD_GRAB_POWER, cs);
+        }
+        else
+            send_client_status(IOD_EVENT_GRAB,
+                IOD_GRAB_POWER, cs);
+        break;
+    }
+}
+
+void hello_client(struct chain_socket *cs, int value)
+{
+    int version = value & IOD_HELLO_VERSION;
+    
+    if(version > IOD_VERSION)
+        version = IOD_VERSION;
+    if(version < 1 || cs->version > 1)
+        return;
+    
+    // ack is the last v1 event
+    send_client_status(IOD_EVENT_HELLO, version, cs);
+    if(version > 1)
+        cs->qv1 = cs->qcount;
+    cs->version = version;
+    
+    DEBUG(printf("Client protocol v%i [%i] %i\n", version, cs->sock, cs->pid));
+    
+    if(value & IOD_HELLO_RING)
+        ring_client(cs);
+}
+
+// returns 1 if client was removed
+int exec_client(struct chain_socket *cs, struct iod_cmd cmd, union cmd_fields *fields)
+{
+    struct chain_socket *cs2;
+    
+    switch(cmd.cmd)
+    {
+    case IOD_CMD_HELLO:
+        hello_client(cs, cmd.value);
+        break;
+    case IOD_CMD_REGISTER:
+        register_client(cs, cmd.pid);
+        if(cmd.value & IOD_REGISTER_RING)
+            ring_client(cs);
+        break;
+    case IOD_CMD_REMOVE:
+        if(!cmd.pid || (cs2 = find_client(cmd.pid)) == cs)
+        {
+            remove_client(cs);
+            return 1;
+        }
+        else if(cs2)
+        {
+            DEBUG(printf("Client remove [%i] %i\n",
+                cs2->sock, cs2->pid));
+            // no ACK without lifecycle events, hangup removes it
+            if(cs2->classes & IOD_CLASS_LIFECYCLE)
+                send_client_status(IOD_EVENT_REMOVED, 0, cs2);
+            else
+                shutdown(cs2->sock, SHUT_RDWR);
+        }
+        break;
+    case IOD_CMD_SWITCH:
+        cs2 = active;
+        if(switch_client(cmd.value, cs, cmd.pid))
+            deactivate_client(cs2);
+        break;
+    case IOD_CMD_LOCK:
+        if(!lock || cs->lock)
+        {
+            lock = cs->lock = cmd.value;
+            DEBUG(printf("Screen %s [%i] %i\n",
+                lock ? "locked" : "unlocked",
+                cs->sock, cs->pid));
+            send_client_status(IOD_EVENT_LOCK, IOD_SUCCESS_MASK, cs);
+        }
+        else
+            send_client_status(IOD_EVENT_LOCK, 0, cs);
+        break;
+    case IOD_CMD_HIDE:
+        hide_client(cs, cmd.pid,
+            cmd.value & ~IOD_HIDE_MASK,
+            cmd.value & IOD_HIDE_MASK);
+        break;
+    case IOD_CMD_ACK:
+        switch(cmd.value)
+        {
+        case IOD_EVENT_DEACTIVATED:
+            // late after the deadline or superseded by a newer switch
+            if(cs != switching)
+            {
+                DEBUG(printf("Client ACK ignored [%i] %i\n", cs->sock, cs->pid));
+                break;
+            }
+            DEBUG(printf("Client switched [%i] %i -> [%i] %i\n",
+                cs->sock, cs->pid, active->sock, active->pid));
+            finish_switch();
+            break;
+        case IOD_EVENT_REMOVED:
+            remove_client(cs);
+            return 1;
+        default:
+            DEBUG(printf("Client done [%i] %i\n", cs->sock, cs->pid));
+            break;
+        }
+        break;
+    case IOD_CMD_GRAB:
+        grab_client(cs, cmd.value);
+        break;
+    case IOD_CMD_POWERSAVE:
+        DEBUG(printf("Powersave %s broadcast\n",
+            cmd.value ? "on" : "off"));
+        LIST_FOREACH(cs2, &powersave_list, powersave)
+        {
+            if(cs2 != cs)
+                send_client_status(IOD_EVENT_POWERSAVE, cmd.value, cs2);
+        }
+        break;
+    case IOD_CMD_SUBSCRIBE:
+        subscribe_client(cs, cmd.value);
+        break;
+    case IOD_CMD_REGION:
+        region_client(cs, cmd.value, &fields->region);
+        break;
+    case IOD_CMD_TOPIC:
+        topic_client(cs, cmd.value, &fields->message);
+        break;
+    case IOD_CMD_PUBLISH:
+        publish_client(cs, &fields->message);
+        break;
+    default:
+        DEBUG(printf("Unrecognized command 0x%02hhx [%i] %i\n",
+            cmd.cmd, cs->sock, cs->pid));
+    }
+    
+    return 0;
+}
+
+void handle_client(struct chain_socket *cs, uint32_t events)
+{
+    struct client_cmd cmd;
+    int ret;
+    
+    if(events & (EPOLLHUP|EPOLLERR))
+    {
+        DEBUG(printf("pollhup/pollerr on client socket [%i]\n", cs->sock));
+        remove_client(cs);
+        return;
+    }
+    
+    if(events & EPOLLOUT)
+        flush_client(cs);
+    
+    if(!(events & EPOLLIN) || recv_client(cs))
+        return;
+    
+    // all complete commands, a v2 frame may carry several
+    while(!(ret = next_cmd(cs, &cmd)))
+        if(exec_client(cs, cmd.cmd, &cmd.fields))
+            return;
+    
+    if(ret == -2)
+    {
+        DEBUG(printf("Broken frame from client [%i] %i\n", cs->sock, cs->pid));
+        remove_client(cs);
+    }
+}
+
+// one epoll wakeup, returns exit code on failure
+int handle_events(struct epoll_event *events, int count)
+{
+    uint32_t screen_events, aux_events, power_events, input_events;
+    struct epoll_event *ev;
+    int ret;
+    
+    screen_events = aux_events = power_events = input_events = 0;
+    
+    // commands first so switches, grabs and locks apply to the input
+    // of this wakeup, each client gets one recv of CMD_BUFFER bytes
+    for(ev=events; ev<events+count; ev++)
+    {
+        if(ev->data.ptr == &screen_fd)
+            screen_events = ev->events;
+        else if(ev->data.ptr == &aux_fd)
+            aux_events = ev->events;
+        else if(ev->data.ptr == &power_fd)
+            power_events = ev->events;
+        else if(ev->data.ptr == &input_efd)
+            input_events = ev->events;
+        else if(ev->data.ptr == &sock)
+        {
+            if(ev->events & (EPOLLHUP|EPOLLERR))
+            {
+                DEBUG(printf("pollhup/err on socket\n"));
+                close(sock);
+                if((ret = open_socket(&sock, IOD_SOCK)) || watch_fd(sock, &sock))
+                {
+                    sock = 0;
+                    return ret ? ret : 14;
+                }
+            }
+            else
+                accept_client();
+        }
+        else if(ev->data.ptr == &stats_sock)
+            send_stats();
+        else if(ev->data.ptr == &gesture_fd)
+            handle_gesture();
+        else if(ev->data.ptr == &switch_fd)
+            handle_switch();
+        else
+            handle_client(ev->data.ptr, ev->events);
+    }
+    
+    // one read of INPUT_BATCH events per device, buttons before the
+    // screen, a busy screen continues on the next wakeup
+    if(power_events)
+    {
+        if(power_events & (EPOLLHUP|EPOLLERR))
+        {
+            DEBUG(printf("pollhup/err on power socket\n"));
+            if(reopen_input(&power_fd, power_dev))
+            {
+                perror("Failed to open power socket");
+                return 10;
+            }
+        }
+        else
+            handle_power(read_input(power_fd, IOD_TRACE_POWER, &power_stats));
+    }
+    if(aux_events)
+    {
+        if(aux_events & (EPOLLHUP|EPOLLERR))
+        {
+            DEBUG(printf("pollhup/err on aux socket\n"));
+            if(reopen_input(&aux_fd, aux_dev))
+            {
+                perror("Failed to open aux socket");
+                return 8;
+            }
+        }
+        else
+            handle_aux(read_input(aux_fd, IOD_TRACE_AUX, &aux_stats));
+    }
+    if(screen_events)
+    {
+        if(screen_events & (EPOLLHUP|EPOLLERR))
+        {
+            DEBUG(printf("pollhup/err on screen socket\n"));
+            if(reopen_input(&screen_fd, screen_dev))
+            {
+                perror("Failed to open screen socket");
+                return 6;
+            }
+        }
+        else
+            handle_screen(read_input(screen_fd, IOD_TRACE_SCREEN, &screen_stats));
+    }
+    if(input_events)
+    {
+        if(input_error)
+        {
+            return input_error;
+        }
+        handle_inputs();
     }
     
-    return cs;
+    return 0;
 }
 
-struct chain_socket* client_list_rotate(int dir)
+// post the next read of a device, after it is readable
+int arm_input(int device)
 {
-    client_list.cqh_last->chain.cqe_next = client_list.cqh_first;
-    client_list.cqh_first->chain.cqe_prev = client_list.cqh_last;
-    if(dir > 0)
-    {
-        client_list.cqh_last = client_list.cqh_first;
-        client_list.cqh_first = client_list.cqh_first->chain.cqe_next;
-    }
-    else
+    int *fds[] = { &screen_fd, &aux_fd, &power_fd };
+    
+    // a plain read of an O_NONBLOCK device may complete with EAGAIN
+    if(iod_uring_space(&uring, 2) || iod_uring_poll(&uring, *fds[device], POLLIN, 0, 1)
+        || iod_uring_read(&uring, *fds[device], uring_inputs[device],
+        sizeof(uring_inputs[device]), fds[device]))
     {
-        client_list.cqh_first = client_list.cqh_last;
-        client_list.cqh_last = client_list.cqh_last->chain.cqe_prev;
+        perror("Failed to post input read");
+        return -1;
     }
-    client_list.cqh_last->chain.cqe_next = (void*)&client_list;
-    client_list.cqh_first->chain.cqe_prev = (void*)&client_list;
     
-    return client_list.cqh_first;
+    return 0;
 }
 
-struct chain_socket* client_list_rotate_next(int hidden)
+// completed read of res bytes from a device, returns exit code on failure
+int uring_input(int device, int res)
 {
-    struct chain_socket *cs, *cs_nxt;
+    int *fds[] = { &screen_fd, &aux_fd, &power_fd };
+    char **devs[] = { &screen_dev, &aux_dev, &power_dev };
+    struct input_stats *stats[] = { &screen_stats, &aux_stats, &power_stats };
+    const int errors[] = { 6, 8, 10 };
+    int count;
     
-    cs = cs_nxt = client_list.cqh_first;
-    
-    if(cs == (void*)&client_list)
-        return 0;
-    
-    while(cs != (void*)&client_list)
+    if(res > 0)
     {
-        if(!cs->hide && !hidden)
+        stats[device]->reads++;
+        memcpy(inputs+INPUT_SLACK, uring_inputs[device], res);
+        count = sync_input(*fds[device], device, inputs,
+            res/sizeof(struct input_event), stats[device]);
+        account_input(device, count, stats[device]);
+        switch(device)
         {
-            cs_nxt = cs;
+        case IOD_TRACE_SCREEN:
+            handle_screen(count);
+            break;
+        case IOD_TRACE_AUX:
+            handle_aux(count);
+            break;
+        case IOD_TRACE_POWER:
+            handle_power(count);
             break;
         }
-        if(cs->hide)
+    }
+    else if(res != -EAGAIN && res != -EINTR)
+    {
+        // end of file after a hangup, or the linked poll failed
+        DEBUG(printf("hangup/error %i on input %i\n", res, device));
+        if(reopen_input(fds[device], *devs[device]))
         {
-            if(!cs_nxt->hide || cs->priority > cs_nxt->priority)
-                cs_nxt = cs;
+            perror("Failed to reopen input");
+            return errors[device];
         }
-        cs = cs->chain.cqe_next;
     }
     
-    if(hidden && !cs_nxt->hide)
-        return 0;
-    
-    if(client_list.cqh_first != cs_nxt)
-        while(client_list_rotate(+1) != cs_nxt);
-    
-    return cs_nxt;
+    return arm_input(device) ? 14 : 0;
 }
 
-int rem_client(int pos, struct chain_socket *cs)
+void accept_uring(int res, int more)
 {
-    int active = cs == client_list.cqh_first;
-    DEBUG(int fd = cs->sock);
-    DEBUG(pid_t pid = cs->pid);
+    if(res >= 0)
+        welcome_client(res);
+    else if(res == -EINVAL && uring.multishot)
+        // before 5.19, one accept per submission
+        uring.multishot = 0;
+    else
+        DEBUG(printf("Failed to accept client: %s\n", strerror(-res)));
     
-    memmove(pfds+pos, pfds+pos+1, (client_count-1)*sizeof(struct pollfd));
-    CIRCLEQ_REMOVE(&client_list, cs, chain);
-    free(cs);
-    client_count--;
+    if(!more && iod_uring_accept(&uring, sock, SOCK_NONBLOCK, &sock))
+        DEBUG(perror("Failed to post accept"));
+}
+
+// one io_uring wakeup, commands before input like the epoll loop,
+// returns exit code on failure
+int handle_uring(struct epoll_event *events)
+{
+    int *fds[] = { &screen_fd, &aux_fd, &power_fd };
+    int sizes[IOD_TRACE_DEVICES];
+    int res, more, device, count, ret, ready = 0, reads = 0;
+    void *data;
     
-    if(client_list.cqh_first != (void*)&client_list)
+    while(iod_uring_complete(&uring, &data, &res, &more))
     {
-        if(active)
-        {
-            if((cs = client_list_rotate_next(0))->hide)
-                DEBUG(printf("Active client removed [%i] %i, switch invisible [%i] %i\n",
-                    fd, pid, cs->sock, cs->pid));
-            else
-                DEBUG(printf("Active client removed [%i] %i, switch [%i] %i\n",
-                    fd, pid, cs->sock, cs->pid));
-            return 1;
-        }
+        // polls linked to device reads and cancels
+        if(!data)
+            continue;
+        
+        if(data == &epfd)
+            ready = 1;
+        else if(data == &sock)
+            accept_uring(res, more);
         else
         {
-            DEBUG(printf("Client removed [%i] %i\n", fd, pid));
-            return 0;
+            for(device=0; device<IOD_TRACE_DEVICES && data != fds[device]; device++);
+            if(device < IOD_TRACE_DEVICES)
+            {
+                reads |= 1<<device;
+                sizes[device] = res;
+            }
+            else
+                sent_uring(data, res);
         }
     }
-    else
-    {
-        DEBUG(printf("Active client removed [%i] %i, last\n", fd, pid));
-        return 0;
-    }
-}
-
-int switch_client(int cmd, int pos, pid_t pid)
-{
-    struct chain_socket *cs = client_list.cqh_first, *cs2;
-    int dir = +1;
     
-    if(cs == (void*)&client_list || cs->chain.cqe_next == (void*)&client_list)
-        return 0;
-    
-    switch(cmd)
+    // clients, timers and stats stay on epoll, polled through the ring
+    if(ready)
     {
-    case IOD_SWITCH_PID:
-        if(pid)
+        if((count = epoll_wait(epfd, events, EPOLL_EVENTS, 0)) > 0
+            && (ret = handle_events(events, count)))
         {
-            if(cs->pid == pid)
-                return 0;
-            while((cs2 = client_list_rotate(+1))->pid != pid && cs != cs2);
-            if(cs == cs2)
-                return 0;
+            return ret;
         }
-        else
-        {
-            if(cs->sock == pfds[pos].fd)
-                return 0;
-            while((cs2 = client_list_rotate(+1))->sock != pfds[pos].fd && cs != cs2);
-            if(cs == cs2)
-                return 0;
-        }
-        break;
-    case IOD_SWITCH_PREV:
-        dir = -1;
-    case IOD_SWITCH_NEXT:
-        while((cs2 = client_list_rotate(dir))->hide && cs != cs2);
-        if(cs == cs2)
-            return 0;
-        break;
-    case IOD_SWITCH_HIDDEN:
-        if(!(cs2 = client_list_rotate_next(1)) || cs == cs2)
-            return 0;
-        break;
+        // one-shot like level triggered, fds still ready complete at once
+        if(iod_uring_poll(&uring, epfd, POLLIN, &epfd, 0))
+            return 14;
     }
     
-    DEBUG(printf("Client switch [%i] %i\n",
-        client_list.cqh_first->sock, client_list.cqh_first->pid));
+    // buttons before the screen
+    for(device=IOD_TRACE_DEVICES-1; device>=0; device--)
+        if(reads & 1<<device && (ret = uring_input(device, sizes[device])))
+            return ret;
     
-    return 1;
-}
-
-void register_client(int pos, pid_t pid)
-{
-    struct chain_socket *cs;
-    
-    if(!(cs = find_client(&pos, 0)))
-        return;
-    
-    cs->pid = pid;
-    
-    DEBUG(printf("Client registered [%i] %i\n", cs->sock, pid));
-}
-
-void hide_client(int pos, pid_t pid, int priority, int hide)
-{
-    struct chain_socket *cs;
-    
-    if(!(cs = find_client(&pos, pid)))
-        return;
-    
-    cs->priority = priority;
-    cs->hide = hide;
-    
-    DEBUG(printf("Client set %s (%i) [%i] %i\n",
-        hide ? "invisible" : "visible", priority, cs->sock, cs->pid));
-}
-
-void free_clients()
-{
-    struct chain_socket *cs;
-    while((cs = client_list.cqh_first) != (void*)&client_list)
-    {
-        CIRCLEQ_REMOVE(&client_list, cs, chain);
-        free(cs);
-    }
-}
-
-void cleanup()
-{
-    DEBUG(printf("cleanup\n"));
-    if(screen_fd)
-        close(screen_fd);
-    if(aux_fd)
-        close(aux_fd);
-    if(power_fd)
-        close(power_fd);
-    if(sock)
-        close(sock);
-    free(screen_dev);
-    free(aux_dev);
-    free(power_dev);
-    free(pfds);
-    free_clients();
-}
-
-void signal_handler(int signal)
-{
-    cleanup();
-    exit(0);
+    return 0;
 }
 
 #ifndef NDEBUG
@@ -493,30 +3283,36 @@ void print_info(int fd)
 
 void usage(const char *name)
 {
-    printf("Usage: %s [-f] [-d pwd] <config>\n", name);
+    printf("Usage: %s [-f] [-d pwd] [-b backlog] [-p pressure] [-m|-a samples] [-z pixels] [-r trace] [-t ms] [-i] [-u] [-R prio] [-c cpu] <config>\n", name);
+    printf("  -p  min pressure to press\n");
+    printf("  -m  median of last samples\n");
+    printf("  -a  average of last samples\n");
+    printf("  -z  dead zone for MOVED\n");
+    printf("  -r  record input to trace file\n");
+    printf("  -t  switch deadline for the DEACTIVATED ACK, 0 waits forever\n");
+    printf("  -i  read input in a separate thread\n");
+    printf("  -u  io_uring main loop, falls back to epoll\n");
+    printf("  -R  realtime priority (suggested %i), locks memory\n", IOD_RT_PRIO);
+    printf("  -c  pin to cpu\n");
 }
 
 int main(int argc, char* argv[])
 {
     int opt, ret;
-    int daemon = 1, lock = 0;
-    int screen_status, aux_pressed, power_pressed, y, x;
-    char *config;
+    int daemon = 1, cpu = -1;
+    char *config, *trace_file = 0;
     FILE *file;
-    struct sockaddr_un addr;
     
-    struct chain_socket *aux_grabber = 0, *power_grabber = 0;
-    
-    struct input_event input;
-    struct iod_cmd cmd;
-    struct chain_socket *cs;
+    struct epoll_event events[EPOLL_EVENTS];
+    int count;
     
     size_t size;
     
-    y = x = screen_status = aux_pressed = power_pressed = 0;
     pwd = IOD_PWD;
+    backlog = BACKLOG;
+    switch_deadline = SWITCH_DEADLINE;
     
-    while((opt = getopt(argc, argv, "fd:")) != -1)
+    while((opt = getopt(argc, argv, "fd:b:p:m:a:z:r:t:iuR:c:")) != -1)
     {
         switch(opt)
         {
@@ -526,6 +3322,42 @@ int main(int argc, char* argv[])
         case 'd':
             pwd = optarg;
             break;
+        case 'b':
+            if((backlog = atoi(optarg)) < 1)
+                backlog = 1;
+            break;
+        case 'p':
+            pressure_min = atoi(optarg);
+            break;
+        case 'm':
+        case 'a':
+            smooth_median = opt == 'm';
+            if((smooth = atoi(optarg)) > FILTER_SAMPLES)
+                smooth = FILTER_SAMPLES;
+            break;
+        case 'z':
+            dead_zone = atoi(optarg);
+            break;
+        case 'r':
+            trace_file = optarg;
+            break;
+        case 't':
+            if((switch_deadline = atoi(optarg)) < 0)
+                switch_deadline = 0;
+            break;
+        case 'i':
+            threaded = 1;
+            break;
+        case 'u':
+            uring_loop = 1;
+            break;
+        case 'R':
+            if((realtime = atoi(optarg)) < 0)
+                realtime = 0;
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
         default:
             usage(argv[0]);
             return 0;
@@ -584,6 +3416,12 @@ int main(int argc, char* argv[])
         }
     }
     
+    if(trace_file && open_trace(trace_file))
+    {
+        perror("Failed to open trace file");
+        return 15;
+    }
+    
     if(!(file = fopen(config, "r")))
     {
         perror("Failed to open config file");
@@ -597,7 +3435,7 @@ int main(int argc, char* argv[])
     }
     screen_dev[size-1] = 0;
     
-    if((screen_fd = open(screen_dev, O_RDONLY)) == -1)
+    if((screen_fd = open_input(screen_dev)) == -1)
     {
         perror("Failed to open screen socket");
         return 6;
@@ -610,7 +3448,7 @@ int main(int argc, char* argv[])
     }
     aux_dev[size-1] = 0;
     
-    if((aux_fd = open(aux_dev, O_RDONLY)) == -1)
+    if((aux_fd = open_input(aux_dev)) == -1)
     {
         perror("Failed to open aux socket");
         return 8;
@@ -624,7 +3462,7 @@ int main(int argc, char* argv[])
     power_dev[size-1] = 0;
     fclose(file);
     
-    if((power_fd = open(power_dev, O_RDONLY)) == -1)
+    if((power_fd = open_input(power_dev)) == -1)
     {
         perror("Failed to open power socket");
         return 10;
@@ -634,376 +3472,133 @@ int main(int argc, char* argv[])
     DEBUG(print_info(aux_fd));
     DEBUG(print_info(power_fd));
     
-    if((ret = open_socket(&sock, &addr)))
+    if((ret = open_socket(&sock, IOD_SOCK)) || (ret = open_socket(&stats_sock, IOD_STATS)))
+    {
+        cleanup();
         return ret;
+    }
     
-    pfds_cap = 10;
-    pfds = malloc(pfds_cap*sizeof(struct pollfd));
-    pfds[0].fd = screen_fd;
-    pfds[0].events = POLLIN;
-    pfds[1].fd = aux_fd;
-    pfds[1].events = POLLIN;
-    pfds[2].fd = power_fd;
-    pfds[2].events = POLLIN;
-    pfds[3].fd = sock;
-    pfds[3].events = POLLIN;
+    if((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        perror("Failed to create epoll");
+        cleanup();
+        return 14;
+    }
     
-    client_count = 0;
-    CIRCLEQ_INIT(&client_list);
+    if((gesture_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+    {
+        perror("Failed to create gesture timer");
+        gesture_fd = 0;
+        cleanup();
+        return 16;
+    }
     
-    signal(SIGINT, signal_handler);
+    if((switch_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+    {
+        perror("Failed to create switch timer");
+        switch_fd = 0;
+        cleanup();
+        return 16;
+    }
     
-    DEBUG(printf("Ready\n"));
+    // best effort, old kernels stay on epoll
+    if(uring_loop && iod_uring_init(&uring, URING_ENTRIES) == -1)
+    {
+        perror("Failed to set up io_uring, using epoll");
+        uring_loop = 0;
+    }
     
-    while(1)
+    // the io_uring loop accepts itself and polls the epoll set
+    if((uring_loop ? iod_uring_accept(&uring, sock, SOCK_NONBLOCK, &sock)
+        || iod_uring_poll(&uring, epfd, POLLIN, &epfd, 0) : watch_fd(sock, &sock))
+        || watch_fd(stats_sock, &stats_sock)
+        || watch_fd(gesture_fd, &gesture_fd) || watch_fd(switch_fd, &switch_fd))
     {
-        poll(pfds, client_count+4, -1);
-        
-        if(pfds[0].revents & POLLHUP || pfds[0].revents & POLLERR)
-        {
-            DEBUG(printf("pollhup/err on screen socket\n"));
-            close(screen_fd);
-            if((screen_fd = open(screen_dev, O_RDONLY)) < 0)
-            {
-                perror("Failed to open screen socket");
-                screen_fd = 0;
-                cleanup();
-                return 6;
-            }
-        }
-        else if(pfds[0].revents & POLLIN)
-        {
-            read(screen_fd, &input, sizeof(struct input_event));
-            
-            if(lock)
-                continue;
-            
-            switch(input.type)
-            {
-            case EV_KEY:
-                switch(input.code)
-                {
-                case BTN_TOUCH:
-                    switch(input.value)
-                    {
-                        case 0:
-                            screen_status = 0;
-                            break;
-                        case 1:
-                            screen_status = 1;
-                            break;
-                    }
-                    break;
-                }
-                break;
-            case EV_ABS:
-                switch(input.code)
-                {
-                case ABS_X:
-                    y = input.value-MIN_PIXEL;
-                    break;
-                case ABS_Y:
-                    x = input.value-MIN_PIXEL;
-                    break;
-                case ABS_PRESSURE:
-                    break;
-                }
-                break;
-            case EV_SYN:
-                switch(input.code)
-                {
-                case SYN_REPORT:
-                    switch(screen_status)
-                    {
-                    case 0:
-                        DEBUG(printf("Touchscreen released (%i,%i)\n", y, x));
-                        send_client_cord(IOD_EVENT_RELEASED, y, x, 0);
-                        break;
-                    case 1:
-                        DEBUG(printf("Touchscreen pressed (%i,%i)\n", y, x));
-                        send_client_cord(IOD_EVENT_PRESSED, y, x, 0);
-                        screen_status = 2;
-                        break;
-                    case 2:
-                        send_client_cord(IOD_EVENT_MOVED, y, x, 0);
-                        break;
-                    }
-                    break;
-                }
-                break;
-            }
-        }
-        else if(pfds[1].revents & POLLHUP || pfds[1].revents & POLLERR)
+        cleanup();
+        return 14;
+    }
+    
+    // best effort before the reader thread starts, which inherits it
+    if(cpu >= 0 && iod_rt_affinity(cpu) == -1)
+        perror("Failed to pin cpu, continuing");
+    if(realtime)
+    {
+        if(iod_rt_priority(realtime) == -1)
         {
-            DEBUG(printf("pollhup/err on aux socket\n"));
-            close(aux_fd);
-            if((aux_fd = open(aux_dev, O_RDONLY)) == -1)
-            {
-                perror("Failed to open aux socket");
-                aux_fd = 0;
-                cleanup();
-                return 8;
-            }
+            perror("Failed to set realtime priority, continuing");
+            realtime = 0;
         }
-        else if(pfds[1].revents & POLLIN)
+        // event buffers are static or allocated later, both are locked
+        if(iod_rt_lock() == -1)
+            perror("Failed to lock memory, continuing");
+    }
+    
+    // devices are either watched by the reader thread or the main loop
+    if(threaded)
+    {
+        if(start_reader())
         {
-            read(aux_fd, &input, sizeof(struct input_event));
-            switch(input.type)
-            {
-            case EV_KEY:
-                switch(input.code)
-                {
-                case KEY_PHONE:
-                    aux_pressed = input.value;
-                    break;
-                }
-                break;
-            case EV_SYN:
-                switch(input.code)
-                {
-                case SYN_REPORT:
-                    DEBUG(printf("AUX %s\n",
-                        aux_pressed ? "pressed" : "released"));
-                    cs = aux_grabber ? aux_grabber : 0;
-                    send_client_status(IOD_EVENT_AUX, aux_pressed, cs);
-                    break;
-                }
-                break;
-            }
+            perror("Failed to start input thread");
+            cleanup();
+            return 17;
         }
-        else if(pfds[2].revents & POLLHUP || pfds[2].revents & POLLERR)
+        if(watch_fd(input_efd, &input_efd))
         {
-            DEBUG(printf("pollhup/err on power socket\n"));
-            close(power_fd);
-            if((power_fd = open(power_dev, O_RDONLY)) == -1)
-            {
-                perror("Failed to open power socket");
-                power_fd = 0;
-                cleanup();
-                return 10;
-            }
+            cleanup();
+            return 14;
         }
-        else if(pfds[2].revents & POLLIN)
+    }
+    else if(uring_loop)
+    {
+        if(arm_input(IOD_TRACE_SCREEN) || arm_input(IOD_TRACE_AUX)
+            || arm_input(IOD_TRACE_POWER))
         {
-            read(power_fd, &input, sizeof(struct input_event));
-            switch(input.type)
-            {
-            case EV_KEY:
-                switch(input.code)
-                {
-                case KEY_POWER:
-                    power_pressed = input.value;
-                    break;
-                }
-                break;
-            case EV_PWR:
-                break;
-            case EV_SYN:
-                switch(input.code)
-                {
-                case SYN_REPORT:
-                    DEBUG(printf("Power %s\n",
-                        power_pressed ? "pressed" : "released"));
-                    cs = power_grabber ? power_grabber : 0;
-                    send_client_status(IOD_EVENT_POWER, power_pressed, cs);
-                    break;
-                }
-                break;
-            }
+            cleanup();
+            return 14;
         }
-        else if(pfds[3].revents & POLLHUP || pfds[3].revents & POLLERR)
+    }
+    else if(watch_fd(screen_fd, &screen_fd) || watch_fd(aux_fd, &aux_fd)
+        || watch_fd(power_fd, &power_fd))
+    {
+        cleanup();
+        return 14;
+    }
+    
+    signal(SIGINT, signal_handler);
+    signal(SIGUSR1, signal_handler);
+    
+    start_time = stats_time = iod_hist_now();
+    
+    DEBUG(printf("Ready\n"));
+    
+    while(1)
+    {
+        if(uring_loop)
         {
-            DEBUG(printf("pollhup/err on socket\n"));
-            close(sock);
-            if((ret = open_socket(&sock, &addr)))
-            {
-                sock = 0;
-                cleanup();
-                return ret;
-            }
+            // sends of the last wakeup go with the same syscall
+            submit_clients();
+            count = iod_uring_enter(&uring, 1);
         }
-        else if(pfds[3].revents & POLLIN)
+        else
+            count = epoll_wait(epfd, events, EPOLL_EVENTS, -1);
+        wakeups++;
+        
+        // the enter may return submissions although a signal came
+        if(dump_stats)
         {
-            int client;
-            if((client = accept(sock, 0, 0)) == -1)
-            {
-                DEBUG(perror("Failed to accept client"));
-                continue;
-            }
-            cs = client_list.cqh_first;
-            add_client(client);
-            if(cs != (void*)&client_list)
-                send_client_status(IOD_EVENT_DEACTIVATED, 0, cs);
-            else
-                send_client_status(IOD_EVENT_ACTIVATED, 0, 0);
+            print_all_stats(stdout);
+            fflush(stdout);
+            dump_stats = 0;
         }
-        else
+        
+        // a full completion queue fails the enter until it is drained
+        if(count == -1 && !(uring_loop && errno == EBUSY))
+            continue;
+        
+        if((ret = uring_loop ? handle_uring(events) : handle_events(events, count)))
         {
-            int x;
-            for(x=4; x<client_count+4; x++)
-                if(pfds[x].revents & POLLHUP || pfds[x].revents & POLLERR)
-                {
-                    DEBUG(printf("pollhup/pollerr on client socket [%i]\n", pfds[x].fd));
-                    cs = find_client(&x, 0);
-remove:             if(cs == aux_grabber)
-                    {
-                        DEBUG(printf("AUX ungrabbed [%i] %i\n",
-                            cs->sock, cs->pid));
-                        aux_grabber = 0;
-                    }
-                    if(cs == power_grabber)
-                    {
-                        DEBUG(printf("Power ungrabbed [%i] %i\n",
-                            cs->sock, cs->pid));
-                        power_grabber = 0;
-                    }
-                    if(cs->lock)
-                    {
-                        DEBUG(printf("Screen unlocked [%i] %i\n",
-                            cs->sock, cs->pid));
-                        lock = 0;
-                    }
-                    if(rem_client(x, cs))
-                        send_client_status(IOD_EVENT_ACTIVATED, 0, 0);
-                    break;
-                }
-                else if(pfds[x].revents & POLLIN)
-                {
-                    if(recv_client(pfds[x].fd, &cmd))
-                        break;
-                    switch(cmd.cmd)
-                    {
-                    case IOD_CMD_REGISTER:
-                        register_client(x, cmd.pid);
-                        break;
-                    case IOD_CMD_REMOVE:
-                        if((cs = find_client(&x, cmd.pid)))
-                        {
-                            if(cs->sock == pfds[x].fd)
-                                goto remove;
-                            else
-                            {
-                                DEBUG(printf("Client remove [%i] %i\n",
-                                    cs->sock, cs->pid));
-                                send_client_status(
-                                    IOD_EVENT_REMOVED, 0, cs);
-                            }
-                        }
-                        break;
-                    case IOD_CMD_SWITCH:
-                        cs = client_list.cqh_first;
-                        if(switch_client(cmd.value, x, cmd.pid))
-                            send_client_status(
-                                IOD_EVENT_DEACTIVATED, 0, cs);
-                        break;
-                    case IOD_CMD_LOCK:
-                        cs = find_client(&x, 0);
-                        if(!lock || cs->lock)
-                        {
-                            lock = cs->lock = cmd.value;
-                            DEBUG(printf("Screen %s [%i] %i\n",
-                                lock ? "locked" : "unlocked",
-                                x, cs->pid));
-                            send_client_status(
-                                IOD_EVENT_LOCK, IOD_SUCCESS_MASK, cs);
-                        }
-                        else
-                            send_client_status(
-                                IOD_EVENT_LOCK, 0, cs);
-                        break;
-                    case IOD_CMD_HIDE:
-                        hide_client(x, cmd.pid,
-                            cmd.value & ~IOD_HIDE_MASK,
-                            cmd.value & IOD_HIDE_MASK);
-                        break;
-                    case IOD_CMD_ACK:
-                        switch(cmd.value)
-                        {
-                        case IOD_EVENT_DEACTIVATED:
-                            cs = client_list.cqh_first;
-                            DEBUG(printf("Client switched [%i] %i -> [%i] %i\n",
-                                pfds[x].fd, find_client(&x, 0)->pid,
-                                cs->sock, cs->pid));
-                            send_client_status(
-                                IOD_EVENT_ACTIVATED, 0, 0);
-                            break;
-                        case IOD_EVENT_REMOVED:
-                            cs = find_client(&x, 0);
-                            goto remove;
-                        default:
-                            DEBUG(printf("Client done [%i] %i\n",
-                                pfds[x].fd, find_client(&x, 0)->pid));
-                            break;
-                        }
-                        break;
-                    case IOD_CMD_GRAB:
-                        cs = find_client(&x, 0);
-                        switch(cmd.value & ~IOD_GRAB_MASK)
-                        {
-                        case IOD_GRAB_AUX:
-                            if(!aux_grabber || cs == aux_grabber)
-                            {
-                                if(cmd.value & IOD_GRAB_MASK)
-                                {
-                                    DEBUG(printf("AUX grabbed [%i] %i\n",
-                                        cs->sock, cs->pid));
-                                    aux_grabber = cs;
-                                }
-                                else
-                                {
-                                    DEBUG(printf("AUX ungrabbed [%i] %i\n",
-                                        cs->sock, cs->pid));
-                                    aux_grabber = 0;
-                                }
-                                send_client_status(IOD_EVENT_GRAB,
-                                    IOD_SUCCESS_MASK|IOD_GRAB_AUX, cs);
-                            }
-                            else
-                                send_client_status(IOD_EVENT_GRAB,
-                                    IOD_GRAB_AUX, cs);
-                            break;
-                        case IOD_GRAB_POWER:
-                            if(!power_grabber || cs == power_grabber)
-                            {
-                                if(cmd.value & IOD_GRAB_MASK)
-                                {
-                                    DEBUG(printf("Power grabbed [%i] %i\n",
-                                        cs->sock, cs->pid));
-                                    power_grabber = cs;
-                                }
-                                else
-                                {
-                                    DEBUG(printf("Power ungrabbed [%i] %i\n",
-                                        cs->sock, cs->pid));
-                                    power_grabber = 0;
-                                }
-                                send_client_status(IOD_EVENT_GRAB,
-                                    IOD_SUCCESS_MASK|IOD_GRAB_POWER, cs);
-                            }
-                            else
-                                send_client_status(IOD_EVENT_GRAB,
-                                    IOD_GRAB_POWER, cs);
-                            break;
-                        }
-                        break;
-                    case IOD_CMD_POWERSAVE:
-                        DEBUG(printf("Powersave %s broadcast\n",
-                            cmd.value ? "on" : "off"));
-                        cs = client_list.cqh_first;
-                        while(cs != (void*)&client_list)
-                        {
-                            if(cs->sock != pfds[x].fd)
-                                send_client_status(
-                                    IOD_EVENT_POWERSAVE, cmd.value, cs);
-                            cs = cs->chain.cqe_next;
-                        }
-                        break;
-                    default:
-                        DEBUG(printf("Unrecognized command 0x%02hhx [%i] %i\n",
-                            cmd.cmd, pfds[x].fd, find_client(&x, 0)->pid));
-                    }
-                    break;
-                }
+            cleanup();
+            return ret;
         }
     }
     
@@ -28,6 +28,9 @@
 #define IOD_NAME    "iod"
 #define IOD_PWD     "/var/" IOD_NAME
 #define IOD_SOCK    "iod"
+#define IOD_STATS   "iod.stats" // read-only, sends a text snapshot and closes
+
+#define IOD_VERSION 2   // highest protocol version
 
 #define IOD_CMD_REGISTER    1   // register pid
 #define IOD_CMD_REMOVE      2   // remove app
@@ -37,15 +40,50 @@
 #define IOD_CMD_ACK         6   // ack remove/deactivate
 #define IOD_CMD_GRAB        7   // get exclusive button
 #define IOD_CMD_POWERSAVE   8   // broadcast powersave request
+#define IOD_CMD_HELLO       9   // switch protocol version
+#define IOD_CMD_SUBSCRIBE   10  // set event classes to receive
+#define IOD_CMD_REGION      11  // claim screen region for touches, v2 only
+#define IOD_CMD_TOPIC       12  // subscribe/unsubscribe topic, v2 only
+#define IOD_CMD_PUBLISH     13  // publish message on topic, v2 only
 
 #define IOD_SWITCH_PID      0       // switch to app
 #define IOD_SWITCH_PREV     1       // switch to prev app
 #define IOD_SWITCH_NEXT     2       // switch to next app
 #define IOD_SWITCH_HIDDEN   3       // switch to hidden app (lowest prio)
 #define IOD_HIDE_MASK       (1<<7)  // hide bit|prio
+#define IOD_REGISTER_RING   (1<<0)  // request shared event ring
 #define IOD_GRAB_AUX        0       // grab/ungrab aux
 #define IOD_GRAB_POWER      1       // grab/ungrab power
 #define IOD_GRAB_MASK       (1<<7)  // grab bit|button
+#define IOD_HELLO_VERSION   0xff    // version|flags
+#define IOD_HELLO_RING      (1<<8)  // request shared event ring
+#define IOD_TOPIC_SUBSCRIBE 1       // subscribe, else unsubscribe
+
+#define IOD_CLASS_TOUCH     (1<<0)  // PRESSED, RELEASED
+#define IOD_CLASS_AUX       (1<<1)  // AUX
+#define IOD_CLASS_POWER     (1<<2)  // POWER
+#define IOD_CLASS_LIFECYCLE (1<<3)  // ACTIVATED, DEACTIVATED, REMOVED, PREACTIVATE
+#define IOD_CLASS_POWERSAVE (1<<4)  // POWERSAVE broadcast
+#define IOD_CLASS_LOCK      (1<<5)  // LOCK, GRAB replies
+#define IOD_CLASS_GESTURE   (1<<6)  // GESTURE, not in default
+#define IOD_CLASS_MOVED     (1<<7)  // MOVED
+#define IOD_CLASS_ALL       (~0)
+#define IOD_CLASS_DEFAULT   (IOD_CLASS_ALL & ~IOD_CLASS_GESTURE) // includes future classes
+
+#define IOD_GESTURE_TAP     0   // short press without moving
+#define IOD_GESTURE_DOUBLE  1   // second tap, after its TAP
+#define IOD_GESTURE_LONG    2   // long press without moving
+#define IOD_GESTURE_SWIPE   3   // moved and released, with direction and speed
+#define IOD_GESTURE_UP      0   // y decreasing
+#define IOD_GESTURE_DOWN    1   // y increasing
+#define IOD_GESTURE_LEFT    2   // x decreasing
+#define IOD_GESTURE_RIGHT   3   // x increasing
+
+// GESTURE status: type|direction|speed in pixels per second
+#define IOD_GESTURE(type, dir, speed)   ((type)|(dir)<<4|((unsigned int)(speed))<<16)
+#define IOD_GESTURE_TYPE(status)        ((status) & 0xf)
+#define IOD_GESTURE_DIR(status)         (((status)>>4) & 0xf)
+#define IOD_GESTURE_SPEED(status)       (((unsigned int)(status))>>16)
 
 #define IOD_EVENT_PRESSED       0   // button pressed
 #define IOD_EVENT_RELEASED      1   // button released
@@ -58,9 +96,21 @@
 #define IOD_EVENT_LOCK          8   // screen locked/unlocked
 #define IOD_EVENT_GRAB          9   // button grabbed/ungrabbed
 #define IOD_EVENT_POWERSAVE     10  // powersave request
+#define IOD_EVENT_RING          11  // shared event ring, fds attached
+#define IOD_EVENT_HELLO         12  // protocol version offered/accepted
+#define IOD_EVENT_GESTURE       13  // gesture recognized, see IOD_GESTURE
+#define IOD_EVENT_PREACTIVATE   14  // app will be activated after the switch
+#define IOD_EVENT_MESSAGE       15  // topic message, status is publisher pid
 
 #define IOD_SUCCESS_MASK    (1<<7)  // lock/grab success
 
+#define IOD_RT_PRIO         50      // suggested iod -R priority
+#define IOD_RT_BELOW        10      // realtime apps run this far below iod
+
+#define IOD_TOPIC_SIZE      16      // topic name with terminating zero
+#define IOD_MESSAGE_SIZE    64      // inline message bytes
+#define IOD_MESSAGE_SHM     (1<<0)  // payload in shared memory, fd attached
+
 struct iod_cmd
 {
     unsigned char cmd;
@@ -68,6 +118,34 @@ struct iod_cmd
     int value;
 } __attribute__((packed));
 
+struct iod_region
+{
+    short int y, x;             // top left corner, touch coordinates
+    short int height, width;    // empty releases the claim
+} __attribute__((packed));
+
+// IOD_CMD_REGION record, value is the z order, higher on top
+struct iod_cmd_region
+{
+    struct iod_cmd cmd;
+    struct iod_region region;
+} __attribute__((packed));
+
+struct iod_message
+{
+    char topic[IOD_TOPIC_SIZE];
+    unsigned int size;          // bytes of data or shared memory
+    unsigned char flags;
+    char data[IOD_MESSAGE_SIZE]; // empty if IOD_MESSAGE_SHM
+} __attribute__((packed));
+
+// IOD_CMD_TOPIC and IOD_CMD_PUBLISH record, topic only for IOD_CMD_TOPIC
+struct iod_cmd_message
+{
+    struct iod_cmd cmd;
+    struct iod_message message;
+} __attribute__((packed));
+
 union iod_value
 {
     struct { short int y, x; } cord;
@@ -80,4 +158,46 @@ struct iod_event
     union iod_value value;
 } __attribute__((packed));
 
+// Protocol v1 sends single iod_cmd/iod_event structs. On connect iod
+// offers its version with a v1 IOD_EVENT_HELLO, a client answers with
+// IOD_CMD_HELLO and switches to v2 after the HELLO ack from iod.
+// Clients are registered with their peer pid on connect.
+//
+// Protocol v2 sends frames of count records, records are size/count
+// bytes and start with iod_cmd/iod_tevent, newer fields are appended.
+//
+// A touch sequence goes to the topmost client whose IOD_CMD_REGION
+// contains the PRESSED point, else to the active app. Overlays like a
+// status bar stay live without being switched to.
+//
+// Messages published on a topic are sent to all other subscribers of
+// the topic. Payloads larger than IOD_MESSAGE_SIZE are passed as
+// shared memory fd along with the IOD_CMD_PUBLISH/IOD_EVENT_MESSAGE
+// frame, the publisher must not modify it afterwards.
+
+struct iod_frame
+{
+    unsigned short size;    // bytes of all records
+    unsigned short count;   // records following
+} __attribute__((packed));
+
+struct iod_time
+{
+    unsigned int sec, usec; // input_event time, 0 if no input event
+} __attribute__((packed));
+
+struct iod_tevent
+{
+    unsigned char event;
+    union iod_value value;
+    struct iod_time time;
+} __attribute__((packed));
+
+// IOD_EVENT_MESSAGE record, sent in a frame of its own
+struct iod_tevent_message
+{
+    struct iod_tevent event;
+    struct iod_message message;
+} __attribute__((packed));
+
 #endif
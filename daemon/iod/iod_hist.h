@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __IOD_HIST_H__
+#define __IOD_HIST_H__
+
+#include <stdio.h>
+#include <time.h>
+
+#include "iod.h"
+
+#define IOD_HIST_BUCKETS    24          // power of 2 us buckets
+#define IOD_HIST_LIMIT      10000000    // us, later samples are clock errors
+
+// Latency histogram, bucket i counts samples below 2^i us, the last
+// bucket counts everything above. Percentiles are bucket upper bounds.
+
+struct iod_hist
+{
+    unsigned long count;
+    long long max;          // us
+    unsigned long buckets[IOD_HIST_BUCKETS];
+};
+
+// us, a 32 bit long overflows after 36 minutes of uptime
+static inline long long iod_hist_now()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+// us since input time, -1 if not an input event
+static inline long long iod_hist_since(const struct iod_time *time, long long now)
+{
+    long long us;
+    
+    if(!time->sec && !time->usec)
+        return -1;
+    
+    us = now - (time->sec*1000000LL + time->usec);
+    
+    return us < 0 || us > IOD_HIST_LIMIT ? -1 : us;
+}
+
+static inline void iod_hist_add(struct iod_hist *hist, long long us)
+{
+    int bucket = 0;
+    
+    if(us < 0)
+        return;
+    
+    while(bucket < IOD_HIST_BUCKETS-1 && us >= 1LL<<bucket)
+        bucket++;
+    
+    hist->buckets[bucket]++;
+    hist->count++;
+    if(us > hist->max)
+        hist->max = us;
+}
+
+static inline long long iod_hist_percentile(const struct iod_hist *hist, int percent)
+{
+    unsigned long sum = 0, limit = (hist->count*percent+99)/100;
+    int bucket;
+    
+    for(bucket=0; bucket<IOD_HIST_BUCKETS-1; bucket++)
+        if((sum += hist->buckets[bucket]) >= limit)
+            break;
+    
+    // the max is a tighter bound for the top bucket
+    if(bucket == IOD_HIST_BUCKETS-1 || 1LL<<bucket > hist->max)
+        return hist->max;
+    
+    return 1LL<<bucket;
+}
+
+static inline void iod_hist_print(FILE *file, const char *name, const struct iod_hist *hist)
+{
+    fprintf(file, "%s: %lu samples, p50 %lld us, p99 %lld us, max %lld us\n",
+        name, hist->count, iod_hist_percentile(hist, 50),
+        iod_hist_percentile(hist, 99), hist->max);
+}
+
+#endif
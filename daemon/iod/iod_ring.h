@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __IOD_RING_H__
+#define __IOD_RING_H__
+
+#include "iod.h"
+
+#define IOD_RING_SIZE   512     // events, power of 2
+
+// Single producer (iod) single consumer (client) event ring in shared
+// memory. The eventfd passed along with the ring is the doorbell, iod
+// only rings it if the client announced to sleep via waiting.
+// After closed is set iod continues on the socket, the client has to
+// empty the ring before reading the socket again.
+
+struct iod_ring
+{
+    unsigned int head;      // next write, written by iod
+    unsigned int tail;      // next read, written by client
+    unsigned int waiting;   // client sleeps on doorbell
+    unsigned int closed;    // iod fell back to socket
+    struct iod_tevent events[IOD_RING_SIZE];
+};
+
+// returns -1 if full, 1 if doorbell has to be rung, else 0
+static inline int iod_ring_push(struct iod_ring *ring, const struct iod_tevent *event)
+{
+    unsigned int head = ring->head;
+    
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == IOD_RING_SIZE)
+        return -1;
+    
+    ring->events[head & (IOD_RING_SIZE-1)] = *event;
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+    
+    // pairs with the fence in iod_ring_sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    return __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_ACQ_REL);
+}
+
+// returns -1 if empty, else 0
+static inline int iod_ring_pop(struct iod_ring *ring, struct iod_tevent *event)
+{
+    unsigned int tail = ring->tail;
+    
+    if(__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+        return -1;
+    
+    *event = ring->events[tail & (IOD_RING_SIZE-1)];
+    __atomic_store_n(&ring->tail, tail+1, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+static inline int iod_ring_empty(struct iod_ring *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+// announce sleep, returns -1 if events are pending and sleep is cancelled
+static inline int iod_ring_sleep(struct iod_ring *ring)
+{
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELEASE);
+    
+    // pairs with the fence in iod_ring_push
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    if(iod_ring_empty(ring))
+        return 0;
+    
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELEASE);
+    return -1;
+}
+
+static inline void iod_ring_wake(struct iod_ring *ring)
+{
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELEASE);
+}
+
+static inline void iod_ring_close(struct iod_ring *ring)
+{
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+}
+
+static inline int iod_ring_closed(struct iod_ring *ring)
+{
+    return __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)
+        && iod_ring_empty(ring);
+}
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __IOD_RT_H__
+#define __IOD_RT_H__
+
+#include <unistd.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "iod.h"
+
+#define IOD_RT_STACK    (64*1024)   // bytes of stack faulted in before locking
+
+// Real-time mode is best effort, each step returns -1 with errno set on
+// failure and the caller continues with normal scheduling.
+// cpu_set_t needs _GNU_SOURCE before the first include.
+
+static inline int iod_rt_affinity(int cpu)
+{
+    cpu_set_t set;
+    
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+// SCHED_FIFO for the calling thread, new threads inherit it, 0 reverts
+static inline int iod_rt_priority(int priority)
+{
+    struct sched_param param = { .sched_priority = priority };
+    
+    return sched_setscheduler(0, priority ? SCHED_FIFO : SCHED_OTHER, &param);
+}
+
+// read a byte of every page, mlockall does not populate device mappings
+static inline void iod_rt_prefault(const void *buf, size_t size)
+{
+    const volatile unsigned char *ptr = buf;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t i;
+    
+    for(i=0; i<size; i+=page)
+        (void)ptr[i];
+}
+
+// fault in stack and lock all current and future memory
+static inline int iod_rt_lock()
+{
+    unsigned char stack[IOD_RT_STACK];
+    
+    memset(stack, 0, sizeof(stack));
+    __asm__ __volatile__("" : : "r"(stack) : "memory");
+    
+    return mlockall(MCL_CURRENT|MCL_FUTURE);
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __IOD_TRACE_H__
+#define __IOD_TRACE_H__
+
+#include "iod.h"
+
+#define IOD_TRACE_MAGIC     0x63727469  // "itrc"
+#define IOD_TRACE_VERSION   1
+
+#define IOD_TRACE_SCREEN    0
+#define IOD_TRACE_AUX       1
+#define IOD_TRACE_POWER     2
+#define IOD_TRACE_DEVICES   3
+
+// Trace of the raw input_event streams read by iod. A header is
+// followed by one record per input_event in order of reading. Events
+// without time are stamped with the monotonic time of reading.
+
+struct iod_trace_header
+{
+    unsigned int magic;
+    unsigned int version;
+} __attribute__((packed));
+
+struct iod_trace
+{
+    unsigned char device;
+    struct iod_time time;
+    unsigned short type, code;
+    int value;
+} __attribute__((packed));
+
+#endif
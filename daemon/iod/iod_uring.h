@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef __IOD_URING_H__
+#define __IOD_URING_H__
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// Minimal io_uring without liburing, iod only needs a handful of ops.
+// Without kernel headers or syscall numbers iod_uring_init fails with
+// ENOSYS and the caller stays on epoll.
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#   if __has_include(<linux/io_uring.h>)
+#       include <linux/io_uring.h>
+#       define IOD_URING 1
+#   endif
+#endif
+
+struct iod_uring
+{
+    int fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    char *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    unsigned int entries;   // submission queue entries
+    unsigned int tail;      // next sqe, published on enter
+    unsigned int pending;   // sqes prepared, not submitted yet
+    int multishot;          // multishot accept supported
+#ifdef IOD_URING
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+#ifdef IOD_URING
+
+static inline void iod_uring_free(struct iod_uring *u)
+{
+    if(u->sqes && (void*)u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->entries*sizeof(struct io_uring_sqe));
+    if(u->cq_ptr && (void*)u->cq_ptr != MAP_FAILED)
+        munmap(u->cq_ptr, u->cq_size);
+    if(u->sq_ptr && (void*)u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_size);
+    if(u->fd > 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+}
+
+// ops used by iod, probing needs 5.6 which has all of them
+static inline int iod_uring_probe(struct iod_uring *u)
+{
+    const int ops[] = { IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_SENDMSG,
+        IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL };
+    struct io_uring_probe *probe;
+    int i, ret = 0;
+    
+    if(!(probe = calloc(1, sizeof(*probe) + 256*sizeof(struct io_uring_probe_op))))
+        return -1;
+    
+    if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+        ret = -1;
+    else
+        for(i=0; i<sizeof(ops)/sizeof(int); i++)
+            if(ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                errno = EOPNOTSUPP;
+                ret = -1;
+            }
+    
+    free(probe);
+    return ret;
+}
+
+// returns -1 with errno set if io_uring is unavailable
+static inline int iod_uring_init(struct iod_uring *u, unsigned int entries)
+{
+    struct io_uring_params params;
+    unsigned int i;
+    int err;
+    
+    memset(u, 0, sizeof(*u));
+    memset(&params, 0, sizeof(params));
+    
+    if((u->fd = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+    {
+        u->fd = 0;
+        return -1;
+    }
+    
+    // separate mappings work with and without IORING_FEAT_SINGLE_MMAP
+    u->entries = params.sq_entries;
+    u->sq_size = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    u->cq_size = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    u->sq_ptr = mmap(0, u->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(0, u->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+        u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(0, u->entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    
+    if((void*)u->sq_ptr == MAP_FAILED || (void*)u->cq_ptr == MAP_FAILED
+        || (void*)u->sqes == MAP_FAILED
+        || iod_uring_probe(u) == -1)
+    {
+        err = errno;
+        iod_uring_free(u);
+        errno = err;
+        return -1;
+    }
+    
+    u->sq_head = (void*)(u->sq_ptr + params.sq_off.head);
+    u->sq_tail = (void*)(u->sq_ptr + params.sq_off.tail);
+    u->sq_mask = (void*)(u->sq_ptr + params.sq_off.ring_mask);
+    u->sq_array = (void*)(u->sq_ptr + params.sq_off.array);
+    u->cq_head = (void*)(u->cq_ptr + params.cq_off.head);
+    u->cq_tail = (void*)(u->cq_ptr + params.cq_off.tail);
+    u->cq_mask = (void*)(u->cq_ptr + params.cq_off.ring_mask);
+    u->cqes = (void*)(u->cq_ptr + params.cq_off.cqes);
+    u->tail = *u->sq_tail;
+    
+    // sqes are used in ring order
+    for(i=0; i<u->entries; i++)
+        u->sq_array[i] = i;
+    
+    // multishot accept needs 5.19, cleared on the first EINVAL
+    u->multishot = 1;
+    
+    return 0;
+}
+
+// submit prepared sqes, wait for a completion if wait is set
+static inline int iod_uring_enter(struct iod_uring *u, int wait)
+{
+    int count;
+    
+    __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+    
+    if((count = syscall(__NR_io_uring_enter, u->fd, u->pending, wait ? 1 : 0,
+        wait ? IORING_ENTER_GETEVENTS : 0, 0, 0)) == -1)
+    {
+        return -1;
+    }
+    
+    u->pending -= count;
+    
+    return count;
+}
+
+static inline struct io_uring_sqe* iod_uring_sqe(struct iod_uring *u, int op, int fd, void *data)
+{
+    struct io_uring_sqe *sqe;
+    
+    // full, submit without waiting
+    if(u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries
+        && (iod_uring_enter(u, 0) == -1
+        || u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->entries))
+    {
+        return 0;
+    }
+    
+    sqe = &u->sqes[u->tail++ & *u->sq_mask];
+    u->pending++;
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)data;
+    
+    return sqe;
+}
+
+// room for count sqes, linked sqes must not be split by a submission
+static inline int iod_uring_space(struct iod_uring *u, unsigned int count)
+{
+    if(u->entries - (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) >= count)
+        return 0;
+    if(iod_uring_enter(u, 0) == -1)
+        return -1;
+    return u->entries - (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE)) >= count ? 0 : -1;
+}
+
+// one-shot poll, link runs the next sqe after it
+static inline int iod_uring_poll(struct iod_uring *u, int fd, unsigned int mask,
+    void *data, int link)
+{
+    struct io_uring_sqe *sqe;
+    
+    if(!(sqe = iod_uring_sqe(u, IORING_OP_POLL_ADD, fd, data)))
+        return -1;
+    
+    sqe->poll_events = mask;
+    if(link)
+        sqe->flags = IOSQE_IO_LINK;
+    
+    return 0;
+}
+
+static inline int iod_uring_read(struct iod_uring *u, int fd, void *buf,
+    unsigned int size, void *data)
+{
+    struct io_uring_sqe *sqe;
+    
+    if(!(sqe = iod_uring_sqe(u, IORING_OP_READ, fd, data)))
+        return -1;
+    
+    sqe->addr = (unsigned long)buf;
+    sqe->len = size;
+    // no position, like read(2)
+    sqe->off = -1;
+    
+    return 0;
+}
+
+// msg has to stay valid until the completion
+static inline int iod_uring_sendmsg(struct iod_uring *u, int fd, struct msghdr *msg,
+    int flags, void *data)
+{
+    struct io_uring_sqe *sqe;
+    
+    if(!(sqe = iod_uring_sqe(u, IORING_OP_SENDMSG, fd, data)))
+        return -1;
+    
+    sqe->addr = (unsigned long)msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    
+    return 0;
+}
+
+// multishot keeps accepting until a completion comes without more
+static inline int iod_uring_accept(struct iod_uring *u, int fd, int flags, void *data)
+{
+    struct io_uring_sqe *sqe;
+    
+    if(!(sqe = iod_uring_sqe(u, IORING_OP_ACCEPT, fd, data)))
+        return -1;
+    
+    sqe->accept_flags = flags;
+    if(u->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    
+    return 0;
+}
+
+// the cancelled op completes with -ECANCELED, unless it was done already
+static inline int iod_uring_cancel(struct iod_uring *u, void *data)
+{
+    struct io_uring_sqe *sqe;
+    
+    if(!(sqe = iod_uring_sqe(u, IORING_OP_ASYNC_CANCEL, -1, 0)))
+        return -1;
+    
+    sqe->addr = (unsigned long)data;
+    
+    return 0;
+}
+
+// take the next completion, returns 0 if none
+static inline int iod_uring_complete(struct iod_uring *u, void **data, int *res, int *more)
+{
+    unsigned int head = *u->cq_head;
+    struct io_uring_cqe *cqe;
+    
+    if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    
+    cqe = &u->cqes[head & *u->cq_mask];
+    *data = (void*)(unsigned long)cqe->user_data;
+    *res = cqe->res;
+    *more = !!(cqe->flags & IORING_CQE_F_MORE);
+    __atomic_store_n(u->cq_head, head+1, __ATOMIC_RELEASE);
+    
+    return 1;
+}
+
+#else
+
+static inline int iod_uring_init(struct iod_uring *u, unsigned int entries)
+{
+    memset(u, 0, sizeof(*u));
+    errno = ENOSYS;
+    return -1;
+}
+
+static inline void iod_uring_free(struct iod_uring *u) {}
+static inline int iod_uring_enter(struct iod_uring *u, int wait) { errno = ENOSYS; return -1; }
+static inline int iod_uring_space(struct iod_uring *u, unsigned int count) { return -1; }
+static inline int iod_uring_poll(struct iod_uring *u, int fd, unsigned int mask,
+    void *data, int link) { return -1; }
+static inline int iod_uring_read(struct iod_uring *u, int fd, void *buf,
+    unsigned int size, void *data) { return -1; }
+static inline int iod_uring_sendmsg(struct iod_uring *u, int fd, struct msghdr *msg,
+    int flags, void *data) { return -1; }
+static inline int iod_uring_accept(struct iod_uring *u, int fd, int flags, void *data) { return -1; }
+static inline int iod_uring_cancel(struct iod_uring *u, void *data) { return -1; }
+static inline int iod_uring_complete(struct iod_uring *u, void **data, int *res, int *more) { return 0; }
+
+#endif
+
+#endif
@@ -0,0 +1,834 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <linux/input.h>
+
+#include "iod.h"
+#include "iod_hist.h"
+#include "iod_trace.h"
+#include "iod_rt.h"
+
+#define LOAD_CLIENTS    64      // max synthetic clients
+#define LOAD_HOGS       16      // max busy processes loading the cpu
+#define LOAD_BUFFER     4096    // bytes of received events per client
+#define LOAD_DRAIN      200000  // us, wait for events in flight at the end
+#define LOAD_BEHIND     100000  // us, a generator further behind skips ahead
+#define SWIPE_FRAMES    12      // frames per swipe, press to release
+#define SWIPE_STEP      20      // pixels moved per swipe frame
+#define DRAG_FRAMES     100     // frames per drag, press to release
+#define TOUCH_MIN       150     // raw touch coordinates used
+#define TOUCH_MAX       850
+#define SEQUENCE_COMMANDS 1000  // commands of a -S run
+#define SEQUENCE_SETTLE 10000   // us without events ending a command
+#define DIGEST_INIT     2166136261u // FNV-1a offset basis
+#define START_TRIES     200     // 10 ms waits for the socket of a started iod
+
+#define PATTERN_TAP     0
+#define PATTERN_SWIPE   1
+#define PATTERN_DRAG    2
+
+struct load_client
+{
+    int sock;
+    char in[LOAD_BUFFER];   // received events
+    int in_size;
+    int hide, lock, grab;   // state toggled by the command storm
+    unsigned long events;   // events received
+    unsigned int digest;    // FNV-1a of event types and status, no times
+};
+
+struct load_client clients[LOAD_CLIENTS];
+struct pollfd pfds[LOAD_CLIENTS];
+int client_count, lost;
+int devices[IOD_TRACE_DEVICES];
+int pattern, swipe_dir, touch_y, touch_x;
+pid_t iod_pid;
+pid_t hogs[LOAD_HOGS];
+int hog_count;
+int touch_rate, button_rate, storm_rate, seconds, realtime;
+struct iod_hist latency, power_latency;
+int power_limit;    // us, drag with power presses only, 0 if off
+unsigned long frames, buttons, stalled, commands, acks, delivered;
+
+const char *patterns[] = { "tap", "swipe", "drag" };
+
+// wait blocks until a just started iod opens its end of fifo devices
+int open_devices(const char *config, int wait)
+{
+    char *dev = 0;
+    size_t size = 0;
+    ssize_t len;
+    FILE *file;
+    int i;
+    
+    if(!(file = fopen(config, "r")))
+    {
+        perror("Failed to open config file");
+        return -1;
+    }
+    
+    // same config as iod, one device per line
+    for(i=0; i<IOD_TRACE_DEVICES; i++)
+    {
+        if((len = getline(&dev, &size, file)) == -1)
+        {
+            fprintf(stderr, "Failed to read device config\n");
+            break;
+        }
+        if(dev[len-1] == '\n')
+            dev[len-1] = 0;
+        if((devices[i] = open(dev, O_WRONLY|(wait ? 0 : O_NONBLOCK))) == -1)
+        {
+            perror("Failed to open device");
+            break;
+        }
+        // a full device counts as stalled instead of blocking the clients
+        fcntl(devices[i], F_SETFL, O_NONBLOCK);
+    }
+    
+    free(dev);
+    fclose(file);
+    
+    return i == IOD_TRACE_DEVICES ? 0 : -1;
+}
+
+void add_input(struct input_event *input, int type, int code, int value)
+{
+    input->type = type;
+    input->code = code;
+    input->value = value;
+}
+
+int write_frame(int device, struct input_event *frame, int count)
+{
+    int64_t now = iod_hist_now();
+    int i;
+    
+    // stamp like a device would, delivery latency is measured from here
+    for(i=0; i<count; i++)
+    {
+        frame[i].time.tv_sec = now/1000000;
+        frame[i].time.tv_usec = now%1000000;
+    }
+    
+    // frames are below PIPE_BUF, written whole or not at all
+    if(write(devices[device], frame, count*sizeof(struct input_event)) == -1)
+    {
+        if(errno != EAGAIN)
+        {
+            perror("Failed to write input");
+            return -1;
+        }
+        stalled++;
+    }
+    
+    return 0;
+}
+
+int touch_frame()
+{
+    struct input_event frame[4];
+    int count = 0, step, cycle;
+    
+    cycle = pattern == PATTERN_TAP ? 2 : pattern == PATTERN_SWIPE ? SWIPE_FRAMES : DRAG_FRAMES;
+    step = frames++ % cycle;
+    
+    if(!step)
+    {
+        touch_y = TOUCH_MIN + rand() % (TOUCH_MAX-TOUCH_MIN);
+        touch_x = TOUCH_MIN + rand() % (TOUCH_MAX-TOUCH_MIN);
+        swipe_dir = rand() % 4;
+        add_input(&frame[count++], EV_ABS, ABS_X, touch_y);
+        add_input(&frame[count++], EV_ABS, ABS_Y, touch_x);
+        add_input(&frame[count++], EV_KEY, BTN_TOUCH, 1);
+    }
+    else if(step == cycle-1)
+        add_input(&frame[count++], EV_KEY, BTN_TOUCH, 0);
+    else
+    {
+        if(pattern == PATTERN_SWIPE)
+        {
+            touch_y += swipe_dir == 0 ? -SWIPE_STEP : swipe_dir == 1 ? SWIPE_STEP : 0;
+            touch_x += swipe_dir == 2 ? -SWIPE_STEP : swipe_dir == 3 ? SWIPE_STEP : 0;
+        }
+        else
+        {
+            // small circles, every frame moves
+            touch_y += step % 4 < 2 ? 3 : -3;
+            touch_x += (step+1) % 4 < 2 ? 3 : -3;
+        }
+        add_input(&frame[count++], EV_ABS, ABS_X, touch_y);
+        add_input(&frame[count++], EV_ABS, ABS_Y, touch_x);
+    }
+    add_input(&frame[count++], EV_SYN, SYN_REPORT, 0);
+    
+    return write_frame(IOD_TRACE_SCREEN, frame, count);
+}
+
+int button_frame()
+{
+    struct input_event frame[2];
+    int power = power_limit || buttons/2 % 2;
+    
+    // press and release aux, then power, or only power
+    add_input(&frame[0], EV_KEY, power ? KEY_POWER : KEY_PHONE, !(buttons++ % 2));
+    add_input(&frame[1], EV_SYN, SYN_REPORT, 0);
+    
+    return write_frame(power ? IOD_TRACE_POWER : IOD_TRACE_AUX, frame, 2);
+}
+
+int send_cmd(int sock, int version, unsigned char cmd, pid_t pid, int value)
+{
+    struct
+    {
+        struct iod_frame frame;
+        struct iod_cmd cmd;
+    } __attribute__((packed)) iod;
+    char *ptr = (char*)&iod.cmd;
+    int size = sizeof(struct iod_cmd);
+    
+    iod.cmd.cmd = cmd;
+    iod.cmd.pid = pid;
+    iod.cmd.value = value;
+    
+    if(version > 1)
+    {
+        iod.frame.size = sizeof(struct iod_cmd);
+        iod.frame.count = 1;
+        ptr = (char*)&iod;
+        size = sizeof(iod);
+    }
+    
+    // a full socket loses the command, iod is behind anyway
+    return send(sock, ptr, size, MSG_NOSIGNAL) == size ? 0 : -1;
+}
+
+unsigned int digest_add(unsigned int digest, unsigned int value)
+{
+    int i;
+    
+    for(i=0; i<4; i++, value >>= 8)
+        digest = (digest ^ (value & 0xff)) * 16777619u;
+    
+    return digest;
+}
+
+int connect_client(struct load_client *lc, const char *pwd, int wait)
+{
+    struct sockaddr_un addr;
+    struct iod_event event;
+    struct ucred cred;
+    socklen_t size = sizeof(struct ucred);
+    int tries = 0;
+    
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", pwd, IOD_SOCK);
+    
+    lc->digest = DIGEST_INIT;
+    if((lc->sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        perror("Failed to open socket");
+        return -1;
+    }
+    
+    // a just started iod listens after opening its devices
+    while(connect(lc->sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1)
+    {
+        if(!wait || tries++ == START_TRIES || (errno != ENOENT && errno != ECONNREFUSED))
+        {
+            perror("Failed to connect to iod");
+            return -1;
+        }
+        usleep(10000);
+    }
+    
+    if(!iod_pid && getsockopt(lc->sock, SOL_SOCKET, SO_PEERCRED, &cred, &size) != -1)
+        iod_pid = cred.pid;
+    
+    // v1 events until the HELLO ack, then v2 frames with input time
+    if(recv(lc->sock, &event, sizeof(event), MSG_WAITALL) != sizeof(event)
+        || event.event != IOD_EVENT_HELLO || event.value.status < 2)
+    {
+        fprintf(stderr, "iod does not speak protocol v2\n");
+        return -1;
+    }
+    if(send_cmd(lc->sock, 1, IOD_CMD_HELLO, 0, 2))
+    {
+        perror("Failed to send hello");
+        return -1;
+    }
+    do
+    {
+        if(recv(lc->sock, &event, sizeof(event), MSG_WAITALL) != sizeof(event))
+        {
+            perror("Failed to receive hello");
+            return -1;
+        }
+    }
+    while(event.event != IOD_EVENT_HELLO);
+    
+    fcntl(lc->sock, F_SETFL, O_NONBLOCK);
+    
+    return 0;
+}
+
+void handle_event(struct load_client *lc, struct iod_tevent *event, int64_t now)
+{
+    lc->events++;
+    delivered++;
+    lc->digest = digest_add(digest_add(lc->digest, event->event), event->value.status);
+    iod_hist_add(&latency, iod_hist_since(&event->time, now));
+    // buttons must not starve behind touch input
+    if(event->event == IOD_EVENT_POWER)
+        iod_hist_add(&power_latency, iod_hist_since(&event->time, now));
+    
+    // ack like libneobox so switches do not run into the deadline
+    switch(event->event)
+    {
+    case IOD_EVENT_DEACTIVATED:
+    case IOD_EVENT_REMOVED:
+        if(!send_cmd(lc->sock, 2, IOD_CMD_ACK, 0, event->event))
+            acks++;
+        break;
+    }
+}
+
+// returns -1 if iod closed the connection
+int recv_client(struct load_client *lc)
+{
+    struct iod_frame frame;
+    struct iod_tevent event;
+    int64_t now;
+    int size, pos = 0, rsize, i;
+    
+    if((size = recv(lc->sock, lc->in+lc->in_size, LOAD_BUFFER-lc->in_size, 0)) <= 0)
+        return size == -1 && errno == EAGAIN ? 0 : -1;
+    lc->in_size += size;
+    now = iod_hist_now();
+    
+    // whole frames only, the rest waits for the next recv
+    while(lc->in_size-pos >= sizeof(frame))
+    {
+        memcpy(&frame, lc->in+pos, sizeof(frame));
+        if(!frame.count || frame.size % frame.count
+            || frame.size+sizeof(frame) > LOAD_BUFFER)
+        {
+            fprintf(stderr, "Broken frame\n");
+            return -1;
+        }
+        if(lc->in_size-pos < sizeof(frame)+frame.size)
+            break;
+        
+        pos += sizeof(frame);
+        rsize = frame.size/frame.count;
+        for(i=0; i<frame.count; i++, pos += rsize)
+        {
+            memset(&event, 0, sizeof(event));
+            memcpy(&event, lc->in+pos, rsize < sizeof(event) ? rsize : sizeof(event));
+            handle_event(lc, &event, now);
+        }
+    }
+    
+    memmove(lc->in, lc->in+pos, lc->in_size-pos);
+    lc->in_size -= pos;
+    
+    return 0;
+}
+
+void storm_cmd()
+{
+    struct load_client *lc = &clients[rand() % client_count];
+    int ret = 0, button;
+    
+    if(lc->sock == -1)
+        return;
+    
+    switch(rand() % 7)
+    {
+    case 0:
+        ret = send_cmd(lc->sock, 2, IOD_CMD_SWITCH, 0, IOD_SWITCH_NEXT);
+        break;
+    case 1:
+        ret = send_cmd(lc->sock, 2, IOD_CMD_SWITCH, 0, IOD_SWITCH_PREV);
+        break;
+    case 2:
+        ret = send_cmd(lc->sock, 2, IOD_CMD_SWITCH, 0, IOD_SWITCH_HIDDEN);
+        break;
+    case 3:
+        lc->hide = !lc->hide;
+        ret = send_cmd(lc->sock, 2, IOD_CMD_HIDE, 0,
+            (lc->hide ? IOD_HIDE_MASK : 0) | rand() % 8);
+        break;
+    case 4:
+        button = rand() % 2 ? IOD_GRAB_POWER : IOD_GRAB_AUX;
+        lc->grab ^= 1 << button;
+        ret = send_cmd(lc->sock, 2, IOD_CMD_GRAB, 0,
+            (lc->grab & 1 << button ? IOD_GRAB_MASK : 0) | button);
+        break;
+    case 5:
+        lc->lock = !lc->lock;
+        ret = send_cmd(lc->sock, 2, IOD_CMD_LOCK, 0, lc->lock);
+        break;
+    case 6:
+        ret = send_cmd(lc->sock, 2, IOD_CMD_POWERSAVE, 0, rand() % 2);
+        break;
+    }
+    
+    if(!ret)
+        commands++;
+}
+
+void poll_clients(int64_t timeout)
+{
+    struct timespec ts = { timeout/1000000, (timeout%1000000)*1000 };
+    int i;
+    
+    if(ppoll(pfds, client_count, &ts, 0) <= 0)
+        return;
+    
+    for(i=0; i<client_count; i++)
+    {
+        if(!pfds[i].revents)
+            continue;
+        if(pfds[i].revents & (POLLHUP|POLLERR) || recv_client(&clients[i]))
+        {
+            close(clients[i].sock);
+            // negative fds are ignored by poll
+            clients[i].sock = pfds[i].fd = -1;
+            lost++;
+        }
+    }
+}
+
+// until SEQUENCE_SETTLE passes without an event
+void settle_clients()
+{
+    unsigned long events;
+    
+    do
+    {
+        events = delivered;
+        poll_clients(SEQUENCE_SETTLE);
+    }
+    while(delivered != events);
+}
+
+// Seeded command sequence, each command settles before the next, so
+// the event stream of every client depends on iod alone. Digests of two
+// iod builds match if they handle the sequence the same way.
+void run_sequence(unsigned int seed)
+{
+    unsigned int digest = DIGEST_INIT;
+    int i;
+    
+    settle_clients();
+    srand(seed);
+    for(i=0; i<SEQUENCE_COMMANDS; i++)
+    {
+        storm_cmd();
+        settle_clients();
+    }
+    
+    printf("Sequence: seed %u, %lu commands, %lu acks, %lu events, %i clients lost\n",
+        seed, commands, acks, delivered, lost);
+    for(i=0; i<client_count; i++)
+    {
+        printf("Client %i: %lu events, digest %08x\n", i, clients[i].events, clients[i].digest);
+        digest = digest_add(digest, clients[i].digest);
+    }
+    printf("Digest: %08x\n", digest);
+}
+
+long cpu_ticks()
+{
+    char buf[512], *ptr;
+    unsigned long utime, stime;
+    FILE *file;
+    
+    snprintf(buf, sizeof(buf), "/proc/%i/stat", iod_pid);
+    if(!iod_pid || !(file = fopen(buf, "r")))
+        return -1;
+    ptr = fgets(buf, sizeof(buf), file);
+    fclose(file);
+    
+    // fields after the command name, utime and stime are 14 and 15
+    if(!ptr || !(ptr = strrchr(buf, ')')) || sscanf(ptr+2,
+        "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    {
+        return -1;
+    }
+    
+    return utime + stime;
+}
+
+// busy processes competing with iod for the cpu
+void start_hogs()
+{
+    int i;
+    
+    for(i=0; i<hog_count; i++)
+        if(!(hogs[i] = fork()))
+            while(1);
+}
+
+void stop_hogs()
+{
+    int i;
+    
+    for(i=0; i<hog_count; i++)
+        if(hogs[i] > 0)
+        {
+            kill(hogs[i], SIGKILL);
+            waitpid(hogs[i], 0, 0);
+        }
+}
+
+// generator due time, next is advanced by one period
+int due(int64_t *next, int rate, int64_t now)
+{
+    if(!rate || *next > now)
+        return 0;
+    
+    if(now - *next > LOAD_BEHIND)
+        *next = now;
+    *next += 1000000/rate;
+    
+    return 1;
+}
+
+int connect_load(const char *config, const char *pwd, int wait)
+{
+    int i;
+    
+    if(open_devices(config, wait))
+        return 1;
+    
+    for(i=0; i<client_count; i++)
+    {
+        if(connect_client(&clients[i], pwd, wait))
+            return 2;
+        pfds[i].fd = clients[i].sock;
+        pfds[i].events = POLLIN;
+    }
+    
+    return 0;
+}
+
+// closes clients and devices, the next run starts from zero
+void close_load()
+{
+    int i;
+    
+    // unopened ones are 0 after a failed connect, lost ones -1
+    for(i=0; i<client_count; i++)
+        if(clients[i].sock > 0)
+            close(clients[i].sock);
+    for(i=0; i<IOD_TRACE_DEVICES; i++)
+        if(devices[i] > 0)
+            close(devices[i]);
+    
+    memset(devices, 0, sizeof(devices));
+    memset(clients, 0, sizeof(clients));
+    memset(&latency, 0, sizeof(latency));
+    memset(&power_latency, 0, sizeof(power_latency));
+    iod_pid = lost = 0;
+    frames = buttons = stalled = commands = acks = delivered = 0;
+}
+
+// generates input for the given seconds and prints the report
+int run_load()
+{
+    int ret = 0, clk = sysconf(_SC_CLK_TCK), rt = realtime;
+    int64_t now, start, end, next_touch, next_button, next_storm, next;
+    long ticks;
+    double duration;
+    
+    // hogs first, they must not inherit realtime
+    srand(time(0));
+    start_hogs();
+    
+    // measure iod, not the scheduling of the generator
+    if(rt > 0 && (iod_rt_priority(rt) == -1 || iod_rt_lock() == -1))
+    {
+        perror("Failed to enter realtime mode, continuing");
+        rt = 0;
+    }
+    ticks = cpu_ticks();
+    start = next_touch = next_button = next_storm = iod_hist_now();
+    end = start + seconds*(int64_t)1000000;
+    
+    while((now = iod_hist_now()) < end)
+    {
+        while(!ret && due(&next_touch, touch_rate, now))
+            ret = touch_frame();
+        while(!ret && due(&next_button, button_rate, now))
+            ret = button_frame();
+        if(ret)
+        {
+            stop_hogs();
+            return 3;
+        }
+        while(due(&next_storm, storm_rate, now))
+            storm_cmd();
+        
+        next = end;
+        if(touch_rate && next_touch < next)
+            next = next_touch;
+        if(button_rate && next_button < next)
+            next = next_button;
+        if(storm_rate && next_storm < next)
+            next = next_storm;
+        
+        poll_clients(next - now);
+    }
+    
+    // collect what is still in flight
+    while((now = iod_hist_now()) < end + LOAD_DRAIN)
+        poll_clients(end + LOAD_DRAIN - now);
+    
+    stop_hogs();
+    // hogs of a following run start from normal scheduling again
+    if(rt)
+        iod_rt_priority(0);
+    
+    duration = seconds;
+    printf("Load: %i s, %i clients, %s at %i/s, %i buttons/s, %i commands/s, %i hogs%s\n",
+        seconds, client_count, patterns[pattern], touch_rate, button_rate, storm_rate,
+        hog_count, rt ? ", realtime" : "");
+    printf("Input: %lu frames (%.0f/s), %lu buttons, %lu stalled\n",
+        frames, frames/duration, buttons, stalled);
+    printf("Commands: %lu sent, %lu acks\n", commands, acks);
+    printf("Delivered: %lu events (%.0f/s), %i clients lost\n",
+        delivered, delivered/duration, lost);
+    iod_hist_print(stdout, "Delivery latency", &latency);
+    if(power_latency.count)
+        iod_hist_print(stdout, "Power latency", &power_latency);
+    if(power_limit)
+    {
+        if(!power_latency.count || power_latency.max > power_limit)
+            ret = 4;
+        if(!power_latency.count)
+            printf("Power latency: no POWER events delivered\n");
+        else
+            printf("Power latency %s %i us\n", ret ? "exceeds" : "within", power_limit);
+    }
+    if(ticks != -1 && (now = cpu_ticks()) != -1)
+        printf("iod CPU: %.2f s (%.1f%%)\n", (double)(now-ticks)/clk,
+            (now-ticks)*100.0/clk/duration);
+    
+    return ret;
+}
+
+// iod in the foreground, prio 0 keeps normal scheduling
+pid_t start_iod(const char *iod, const char *pwd, int prio, const char *config)
+{
+    char buf[12];
+    pid_t pid;
+    int fd;
+    
+    if((pid = fork()))
+    {
+        if(pid == -1)
+            perror("Failed to fork iod");
+        return pid;
+    }
+    
+    // the report stays readable, errors still go to stderr
+    if((fd = open("/dev/null", O_WRONLY)) != -1)
+        dup2(fd, 1);
+    snprintf(buf, sizeof(buf), "%i", prio);
+    if(prio)
+        execl(iod, iod, "-f", "-d", pwd, "-R", buf, config, (char*)0);
+    else
+        execl(iod, iod, "-f", "-d", pwd, config, (char*)0);
+    perror("Failed to start iod");
+    _exit(1);
+}
+
+// The same load against iod without and with realtime priority, the
+// hogs of -l are what realtime has to win against.
+int run_bench(const char *iod, const char *pwd, const char *config)
+{
+    struct iod_hist hist[2];
+    int prio[2] = { 0, IOD_RT_PRIO };
+    int i, ret = 0, run;
+    pid_t pid;
+    
+    for(i=0; i<2; i++)
+    {
+        if(prio[i])
+            printf("\niod with -R %i\n", prio[i]);
+        else
+            printf("iod without realtime\n");
+        
+        if((pid = start_iod(iod, pwd, prio[i], config)) == -1)
+            return 5;
+        if(!(run = connect_load(config, pwd, 1)))
+            run = run_load();
+        hist[i] = latency;
+        close_load();
+        kill(pid, SIGINT);
+        waitpid(pid, 0, 0);
+        
+        // a missed power limit still compares, failed runs do not
+        if(run && run != 4)
+            return run;
+        if(!ret)
+            ret = run;
+    }
+    
+    printf("\n");
+    iod_hist_print(stdout, "Without realtime", &hist[0]);
+    iod_hist_print(stdout, "With realtime", &hist[1]);
+    
+    return ret;
+}
+
+void usage(const char *name)
+{
+    printf("Usage: %s [-d pwd] [-c clients] [-r rate] [-g tap|swipe|drag] [-b rate] [-s rate] [-t seconds] [-l hogs] [-R prio] [-P us] [-S seed] [-B iod] <config>\n", name);
+    printf("  -d  iod working dir\n");
+    printf("  -c  synthetic clients (default 4)\n");
+    printf("  -r  touch frames per second (default 1000)\n");
+    printf("  -g  touch pattern (default drag)\n");
+    printf("  -b  button events per second (default 10)\n");
+    printf("  -s  switch/hide/grab/lock commands per second (default 0)\n");
+    printf("  -t  duration in seconds (default 10)\n");
+    printf("  -l  busy processes loading the cpu, for jitter\n");
+    printf("  -R  realtime priority of the generator and clients\n");
+    printf("  -P  drag with power presses only, fails if a POWER event took longer\n");
+    printf("  -S  seeded command sequence without input, prints event digests\n");
+    printf("  -B  start this iod twice, without and with -R %i, and compare\n", IOD_RT_PRIO);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt, ret;
+    int sequence = 0;
+    unsigned int seed = 0;
+    char *pwd = IOD_PWD, *bench = 0;
+    
+    pattern = PATTERN_DRAG;
+    client_count = 4;
+    touch_rate = 1000;
+    button_rate = 10;
+    seconds = 10;
+    
+    while((opt = getopt(argc, argv, "d:c:r:g:b:s:t:l:R:P:S:B:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'd':
+            pwd = optarg;
+            break;
+        case 'c':
+            if((client_count = atoi(optarg)) < 1)
+                client_count = 1;
+            if(client_count > LOAD_CLIENTS)
+                client_count = LOAD_CLIENTS;
+            break;
+        case 'r':
+            if((touch_rate = atoi(optarg)) < 0 || touch_rate > 1000000)
+                touch_rate = 0;
+            break;
+        case 'g':
+            for(pattern=0; pattern<3 && strcmp(optarg, patterns[pattern]); pattern++);
+            if(pattern == 3)
+            {
+                usage(argv[0]);
+                return 0;
+            }
+            break;
+        case 'b':
+            if((button_rate = atoi(optarg)) < 0 || button_rate > 1000000)
+                button_rate = 0;
+            break;
+        case 's':
+            if((storm_rate = atoi(optarg)) < 0 || storm_rate > 1000000)
+                storm_rate = 0;
+            break;
+        case 't':
+            if((seconds = atoi(optarg)) < 1)
+                seconds = 1;
+            break;
+        case 'l':
+            if((hog_count = atoi(optarg)) < 0)
+                hog_count = 0;
+            if(hog_count > LOAD_HOGS)
+                hog_count = LOAD_HOGS;
+            break;
+        case 'R':
+            realtime = atoi(optarg);
+            break;
+        case 'P':
+            if((power_limit = atoi(optarg)) < 1)
+                power_limit = 1;
+            pattern = PATTERN_DRAG;
+            break;
+        case 'S':
+            sequence = 1;
+            seed = strtoul(optarg, 0, 0);
+            break;
+        case 'B':
+            bench = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    
+    if(optind == argc)
+    {
+        usage(argv[0]);
+        return 0;
+    }
+    
+    if(bench)
+        return run_bench(bench, pwd, argv[optind]);
+    
+    if((ret = connect_load(argv[optind], pwd, 0)))
+        return ret;
+    
+    if(sequence)
+        run_sequence(seed);
+    else
+        ret = run_load();
+    
+    close_load();
+    
+    return ret;
+}
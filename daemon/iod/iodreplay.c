@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/input.h>
+
+#include "iod.h"
+#include "iod_trace.h"
+
+#define REPLAY_BATCH    64  // input_events per device write
+
+int devices[IOD_TRACE_DEVICES];
+struct input_event batch[REPLAY_BATCH];
+int batch_count, batch_device;
+
+int64_t now_us()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*(int64_t)1000000 + ts.tv_nsec/1000;
+}
+
+void sleep_until(int64_t us)
+{
+    struct timespec ts = { us/1000000, (us%1000000)*1000 };
+    
+    // other errors would fail again, the replay goes on late
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+int flush_batch()
+{
+    struct input_event *input;
+    int64_t now = now_us();
+    int size = batch_count*sizeof(struct input_event);
+    
+    if(!batch_count)
+        return 0;
+    
+    // stamp like a device would, iod measures latency from here
+    for(input=batch; input<batch+batch_count; input++)
+    {
+        input->time.tv_sec = now/1000000;
+        input->time.tv_usec = now%1000000;
+    }
+    
+    batch_count = 0;
+    
+    if(write(devices[batch_device], batch, size) != size)
+    {
+        perror("Failed to write input");
+        return -1;
+    }
+    
+    return 0;
+}
+
+int open_devices(const char *config)
+{
+    char *dev = 0;
+    size_t size = 0;
+    ssize_t len;
+    FILE *file;
+    int i;
+    
+    if(!(file = fopen(config, "r")))
+    {
+        perror("Failed to open config file");
+        return -1;
+    }
+    
+    // same config as iod, one device per line
+    for(i=0; i<IOD_TRACE_DEVICES; i++)
+    {
+        if((len = getline(&dev, &size, file)) == -1)
+        {
+            fprintf(stderr, "Failed to read device config\n");
+            break;
+        }
+        if(dev[len-1] == '\n')
+            dev[len-1] = 0;
+        if((devices[i] = open(dev, O_WRONLY)) == -1)
+        {
+            perror("Failed to open device");
+            break;
+        }
+    }
+    
+    free(dev);
+    fclose(file);
+    
+    return i == IOD_TRACE_DEVICES ? 0 : -1;
+}
+
+int replay(FILE *file, double speed)
+{
+    struct iod_trace_header header;
+    struct iod_trace record;
+    struct input_event *input;
+    int64_t time, due, first = -1, start = now_us();
+    unsigned long count = 0;
+    
+    if(fread(&header, sizeof(header), 1, file) != 1
+        || header.magic != IOD_TRACE_MAGIC)
+    {
+        fprintf(stderr, "Not a trace file\n");
+        return -1;
+    }
+    if(header.version != IOD_TRACE_VERSION)
+    {
+        fprintf(stderr, "Unsupported trace version %u\n", header.version);
+        return -1;
+    }
+    
+    while(fread(&record, sizeof(record), 1, file) == 1)
+    {
+        if(record.device >= IOD_TRACE_DEVICES)
+            continue;
+        
+        // realtime stamps do not fit a 32 bit long in us
+        time = record.time.sec*(int64_t)1000000 + record.time.usec;
+        if(first == -1)
+            first = time;
+        
+        if(batch_count && (batch_device != record.device || batch_count == REPLAY_BATCH))
+            if(flush_batch())
+                return -1;
+        
+        // 0 replays as fast as possible
+        if(speed > 0 && (due = start + (time - first)/speed) > now_us())
+        {
+            if(flush_batch())
+                return -1;
+            sleep_until(due);
+        }
+        
+        batch_device = record.device;
+        input = &batch[batch_count++];
+        input->type = record.type;
+        input->code = record.code;
+        input->value = record.value;
+        count++;
+        
+        // whole frames are written at once
+        if(record.type == EV_SYN && record.code == SYN_REPORT && flush_batch())
+            return -1;
+    }
+    
+    if(flush_batch())
+        return -1;
+    
+    printf("Replayed %lu events in %.3f s\n", count, (now_us() - start)/1000000.0);
+    
+    return 0;
+}
+
+void usage(const char *name)
+{
+    printf("Usage: %s [-s speed] <config> <trace>\n", name);
+    printf("  -s  speed factor, 0 as fast as possible (default 1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int opt, ret;
+    double speed = 1;
+    FILE *file;
+    
+    while((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        switch(opt)
+        {
+        case 's':
+            if((speed = atof(optarg)) < 0)
+                speed = 0;
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    
+    if(argc - optind != 2)
+    {
+        usage(argv[0]);
+        return 0;
+    }
+    
+    if(open_devices(argv[optind]))
+        return 1;
+    
+    if(!(file = fopen(argv[optind+1], "r")))
+    {
+        perror("Failed to open trace file");
+        return 2;
+    }
+    
+    ret = replay(file, speed) ? 3 : 0;
+    fclose(file);
+    
+    return ret;
+}
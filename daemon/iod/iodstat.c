@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2013-2014 Martin Rödel aka Yomin
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "iod.h"
+
+int print_snapshot(const char *pwd)
+{
+    struct sockaddr_un addr;
+    char buf[4096];
+    int sock, size;
+    
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", pwd, IOD_STATS);
+    
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        perror("Failed to open socket");
+        return 1;
+    }
+    
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1)
+    {
+        perror("Failed to connect to iod");
+        close(sock);
+        return 2;
+    }
+    
+    // iod closes after the snapshot
+    while((size = read(sock, buf, sizeof(buf))) > 0)
+        fwrite(buf, 1, size, stdout);
+    
+    close(sock);
+    fflush(stdout);
+    
+    return size == -1 ? 3 : 0;
+}
+
+void usage(const char *name)
+{
+    printf("Usage: %s [-d pwd] [-w seconds]\n", name);
+    printf("  -d  iod working dir\n");
+    printf("  -w  repeat snapshot every seconds\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int opt, ret;
+    int interval = 0;
+    char *pwd = IOD_PWD;
+    
+    while((opt = getopt(argc, argv, "d:w:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'd':
+            pwd = optarg;
+            break;
+        case 'w':
+            if((interval = atoi(optarg)) < 1)
+                interval = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 0;
+        }
+    }
+    
+    while(!(ret = print_snapshot(pwd)) && interval)
+    {
+        sleep(interval);
+        printf("\n");
+    }
+    
+    return ret;
+}
@@ -30,16 +30,23 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <linux/un.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <pthread.h>
 #include <errno.h>
 #include <getopt.h>
 #include <sys/time.h>
 #include <time.h>
 
 #include "neobox_def.h"
+#include <iod_ring.h>
+#include <iod_rt.h>
 #include "neobox_fb.h"
 #include "neobox_config.h"
 #include "neobox_log.h"
@@ -80,64 +87,123 @@
     } \
     while(0)
 
-#define WRITE_STR(fd, s) write(fd, s, strlen(s))
-#define WRITE_INT_STR(fd, i, x, buf, len, s) \
-    if(!(i)) { (buf)[0]='0'; write(fd, (buf), 1); } \
-    else \
-    { \
-        for((x)=(len)-1; (x)>=0 && (i)>0; (i)/=10,(x)--) \
-            (buf)[x]=(i)%10+'0'; \
-        write(fd, (buf)+(x)+1, (len)-(x)-1); \
-    } \
-    write(fd, s, strlen(s));
-
 struct neobox_global neobox;
 
 int neobox_iod_cmd(unsigned char cmd, pid_t pid, int value);
-int neobox_handle_timer(unsigned char *id, unsigned char *type);
 
-void neobox_signal_handler(int signal)
+int neobox_queue_push(const struct neobox_stash *stash)
 {
-    struct neobox_chain_queue *cq;
-    unsigned char id, type;
-    int ret, err = errno;
+    struct neobox_queue_slot *slot;
+    unsigned int tail = __atomic_load_n(&neobox.queue.tail, __ATOMIC_RELAXED);
+    int diff;
     
-    switch(signal)
+    while(1)
     {
-    case SIGALRM:
-        do
+        slot = &neobox.queue.slots[tail & (QUEUE_SIZE-1)];
+        diff = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - tail;
+        
+        // slot not yet read
+        if(diff < 0)
         {
-            if((ret = neobox_handle_timer(&id, &type)) == -1)
-                continue;
-            if(type == TIMER_SYSTEM)
-            {
-                switch(id)
-                {
-                case 0: neobox.pause = 0; break;
-                case 1: neobox.sleep = 0; break;
-                }
-            }
-            else
-            {
-                cq = malloc(sizeof(struct neobox_chain_queue));
-                CIRCLEQ_INSERT_TAIL(&neobox.queue, cq, chain);
-                cq->stash.type = STASH_NEOBOX;
-                cq->stash.event.neobox.type = NEOBOX_EVENT_TIMER;
-                cq->stash.event.neobox.id = id;
-            }
+            __atomic_add_fetch(&neobox.queue.dropped, 1, __ATOMIC_RELAXED);
+            return -1;
         }
-        while(ret);
-        break;
-    default:
-        cq = malloc(sizeof(struct neobox_chain_queue));
-        CIRCLEQ_INSERT_TAIL(&neobox.queue, cq, chain);
-        cq->stash.type = STASH_NEOBOX;
-        cq->stash.event.neobox.type = NEOBOX_EVENT_SIGNAL;
-        cq->stash.event.neobox.value.i = signal;
+        
+        // tail is updated if another producer was faster
+        if(!diff && __atomic_compare_exchange_n(&neobox.queue.tail, &tail,
+            tail+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            break;
+        
+        if(diff)
+            tail = __atomic_load_n(&neobox.queue.tail, __ATOMIC_RELAXED);
     }
+    
+    slot->stash = *stash;
+    __atomic_store_n(&slot->seq, tail+1, __ATOMIC_RELEASE);
+    
+    return 0;
+}
+
+int neobox_queue_pop(struct neobox_stash *stash)
+{
+    unsigned int head = neobox.queue.head;
+    struct neobox_queue_slot *slot = &neobox.queue.slots[head & (QUEUE_SIZE-1)];
+    
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != head+1)
+        return -1;
+    
+    *stash = slot->stash;
+    __atomic_store_n(&slot->seq, head+QUEUE_SIZE, __ATOMIC_RELEASE);
+    neobox.queue.head = head+1;
+    
+    return 0;
+}
+
+void neobox_signal_handler(int signal)
+{
+    struct neobox_stash stash;
+    int err = errno;
+    
+    // signal_fd signals only get here in threads not blocking them
+    stash.type = STASH_NEOBOX;
+    stash.event.neobox.type = NEOBOX_EVENT_SIGNAL;
+    stash.event.neobox.id = 0;
+    stash.event.neobox.value.i = signal;
+    neobox_queue_push(&stash);
+    
+    // wake the main loop, events pushed by itself are seen anyway
+    eventfd_write(neobox.queue_fd, 1);
+    
     errno = err;
 }
 
+void neobox_signal_fork()
+{
+    // exec'd children get the usual signal mask
+    sigprocmask(SIG_UNBLOCK, &neobox.signals, 0);
+}
+
+int neobox_signal_fd(int sig)
+{
+    struct epoll_event ev;
+    int fd;
+    
+    if(neobox.signal_fd == -1 && pthread_atfork(0, 0, neobox_signal_fork))
+    {
+        neobox_printf(1, "Failed to register fork handler\n");
+        return NEOBOX_ERROR_SIGNAL;
+    }
+    
+    sigaddset(&neobox.signals, sig);
+    
+    if(sigprocmask(SIG_BLOCK, &neobox.signals, 0) == -1)
+    {
+        neobox_perror(1, "Failed to block signal");
+        return NEOBOX_ERROR_SIGNAL;
+    }
+    
+    if((fd = signalfd(neobox.signal_fd, &neobox.signals, SFD_NONBLOCK|SFD_CLOEXEC)) == -1)
+    {
+        neobox_perror(1, "Failed to open signalfd");
+        return NEOBOX_ERROR_SIGNAL;
+    }
+    
+    if(neobox.signal_fd == -1)
+    {
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if(epoll_ctl(neobox.iod.epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            neobox_perror(1, "Failed to poll signalfd");
+            close(fd);
+            return NEOBOX_ERROR_SIGNAL;
+        }
+        neobox.signal_fd = fd;
+    }
+    
+    return 0;
+}
+
 int neobox_catch_signal(int sig, int flags)
 {
     struct sigaction sa;
@@ -147,80 +213,66 @@ int neobox_catch_signal(int sig, int flags)
     
     switch(sig)
     {
-    case SIGALRM:
     case SIGINT:
         return NEOBOX_ERROR_SIGNAL;
     default:
+        // handler stays for flags and threads not blocking the signal
         if(sigaction(sig, &sa, 0) == -1)
         {
             neobox_perror(1, "Failed to catch signal");
             return NEOBOX_ERROR_SIGNAL;
         }
     }
-    return 0;
+    return neobox_signal_fd(sig);
 }
 
-struct neobox_stash neobox_get_event(sigset_t *oldset)
+void neobox_read_signals()
 {
+    struct signalfd_siginfo info[4];
     struct neobox_stash stash;
-    struct neobox_chain_queue *cq;
-    sigset_t set, soldset;
-    
-    sigfillset(&set);
-    stash.type = STASH_NOP;
+    int i, size;
     
-    if(!oldset)
-        oldset = &soldset;
+    stash.type = STASH_NEOBOX;
+    stash.event.neobox.type = NEOBOX_EVENT_SIGNAL;
+    stash.event.neobox.id = 0;
     
-    sigprocmask(SIG_BLOCK, &set, oldset);
-    
-    if((cq = neobox.queue.cqh_first) == (void*)&neobox.queue)
+    // a short read means no more signals are pending
+    do
     {
-        // if oldset exists keep blocking
-        if(oldset == &soldset)
-            sigprocmask(SIG_SETMASK, oldset, 0);
-        return stash;
+        if((size = read(neobox.signal_fd, info, sizeof(info))) <= 0)
+            break;
+        
+        for(i=0; i<size/(int)sizeof(struct signalfd_siginfo); i++)
+        {
+            stash.event.neobox.value.i = info[i].ssi_signo;
+            if(neobox_queue_push(&stash))
+                neobox_printf(1, "Event queue full, signal %i dropped\n",
+                    info[i].ssi_signo);
+        }
     }
-    
-    CIRCLEQ_REMOVE(&neobox.queue, cq, chain);
-    
-    // if oldset exists keep blocking
-    if(oldset == &soldset)
-        sigprocmask(SIG_SETMASK, oldset, 0);
-    
-    stash = cq->stash;
-    free(cq);
-    
-    return stash;
+    while(size == sizeof(info));
 }
 
 void neobox_queue_event(char type, void *event)
 {
-    struct neobox_chain_queue *cq;
-    sigset_t set, oldset;
+    struct neobox_stash stash;
     
     switch(type)
     {
     case STASH_IOD:
-        cq = malloc(sizeof(struct neobox_chain_queue));
-        cq->stash.type = type;
-        cq->stash.event.iod = *(struct iod_event*)event;
+        stash.event.iod = *(struct iod_tevent*)event;
         break;
     case STASH_NEOBOX:
         if(((struct neobox_event*)event)->type == NEOBOX_EVENT_NOP)
             return;
-        cq = malloc(sizeof(struct neobox_chain_queue));
-        cq->stash.type = type;
-        cq->stash.event.neobox = *(struct neobox_event*)event;
+        stash.event.neobox = *(struct neobox_event*)event;
         break;
     }
     
-    sigfillset(&set);
-    sigprocmask(SIG_BLOCK, &set, &oldset);
-    
-    CIRCLEQ_INSERT_TAIL(&neobox.queue, cq, chain);
+    stash.type = type;
     
-    sigprocmask(SIG_SETMASK, &oldset, 0);
+    if(neobox_queue_push(&stash))
+        neobox_printf(1, "Event queue full, event dropped\n");
 }
 
 void neobox_init_partner()
@@ -340,52 +392,138 @@ void neobox_init_save_data()
     }
 }
 
-int neobox_iod_connect(int tries)
+void neobox_iod_ring_detach()
 {
-    struct sockaddr_un addr;
-    int reuse = 1;
+    if(!neobox.iod.ring)
+        return;
     
-    neobox_printf(1, "Connecting to iod socket\n");
+    neobox_printf(1, "Detaching iod ring\n");
     
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, neobox.iod.usock, UNIX_PATH_MAX);
+    // closing the doorbell drops it from the epoll set
+    munmap(neobox.iod.ring, sizeof(struct iod_ring));
+    close(neobox.iod.ring_fd);
+    neobox.iod.ring = 0;
+}
+
+void neobox_iod_ring_attach(int shm, int efd)
+{
+    struct epoll_event ev;
+    void *ring;
     
-    while(1)
+    neobox_iod_ring_detach();
+    
+    neobox_printf(1, "Attaching iod ring\n");
+    
+    ring = mmap(0, sizeof(struct iod_ring), PROT_READ|PROT_WRITE,
+        MAP_SHARED, shm, 0);
+    close(shm);
+    
+    if(ring == MAP_FAILED)
     {
-        if(neobox.iod.sock)
-            while(close(neobox.iod.sock) == -1 && errno == EINTR);
-        
-        if((neobox.iod.sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
-        {
-            neobox_perror(1, "Failed to open iod socket");
-            goto retry;
-        }
-        
-        if(setsockopt(neobox.iod.sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1)
+        neobox_perror(1, "Failed to mmap iod ring");
+        close(efd);
+        return;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.fd = efd;
+    if(epoll_ctl(neobox.iod.epfd, EPOLL_CTL_ADD, efd, &ev) == -1)
+    {
+        neobox_perror(1, "Failed to poll iod ring");
+        munmap(ring, sizeof(struct iod_ring));
+        close(efd);
+        return;
+    }
+    
+    neobox.iod.ring = ring;
+    neobox.iod.ring_fd = efd;
+}
+
+int neobox_iod_ring_pop(struct iod_tevent *event)
+{
+    if(!neobox.iod.ring)
+        return -1;
+    
+    if(!iod_ring_pop(neobox.iod.ring, event))
+    {
+        neobox.iod.received++;
+        return 0;
+    }
+    
+    // iod continues on socket once the ring is emptied
+    if(iod_ring_closed(neobox.iod.ring))
+        neobox_iod_ring_detach();
+    
+    return -1;
+}
+
+void neobox_iod_ring_drop()
+{
+    if(!neobox.iod.ring_shm)
+        return;
+    
+    close(neobox.iod.ring_shm);
+    close(neobox.iod.ring_efd);
+    neobox.iod.ring_shm = neobox.iod.ring_efd = 0;
+}
+
+// record starts with iod_cmd, v1 sends only the iod_cmd,
+// fd is passed along if not -1
+int neobox_iod_send(const void *record, int rsize, int fd)
+{
+    struct
+    {
+        struct iod_frame frame;
+        union
         {
-            neobox_perror(1, "Failed to set SO_REUSEADDR");
-            goto retry;
-        }
-        
-        while(connect(neobox.iod.sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1)
+            struct iod_cmd_region region;
+            struct iod_cmd_message message;
+        } cmd;
+    } __attribute__((packed)) iod;
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int count, err;
+    
+    memcpy(&iod.cmd, record, rsize);
+    iov.iov_base = &iod.cmd;
+    iov.iov_len = sizeof(struct iod_cmd);
+    
+    // v2 sends a frame of one command
+    if(neobox.iod.version > 1)
+    {
+        iod.frame.size = rsize;
+        iod.frame.count = 1;
+        iov.iov_base = &iod;
+        iov.iov_len = sizeof(struct iod_frame)+rsize;
+    }
+    
+    if(fd != -1)
+    {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        *(int*)CMSG_DATA(cmsg) = fd;
+    }
+    
+    while((count = sendmsg(neobox.iod.sock, &msg, 0)) != iov.iov_len)
+    {
+        if(count == -1)
         {
-            if(errno == EINTR)
+            if((err = errno) == EINTR)
                 continue;
-            neobox_perror(1, "Failed to connect iod socket");
-            goto retry;
-        }
-        
-        break;
-        
-retry:  if(tries-- == 1)
-        {
-            neobox_perror(1, "Unable to connect iod socket");
-            return NEOBOX_ERROR_IOD_OPEN;
+            neobox_perror(1, "Failed to send iod cmd");
+            return err;
         }
-        
-        neobox_printf(1, "Retry connecting to iod socket in 1 second\n");
-        
-        while(sleep(1));
+        // the fd went with the first bytes
+        msg.msg_control = 0;
+        msg.msg_controllen = 0;
+        iov.iov_base = (char*)iov.iov_base + count;
+        iov.iov_len -= count;
     }
     
     return 0;
@@ -394,36 +532,199 @@ retry:  if(tries-- == 1)
 int neobox_iod_cmd(unsigned char cmd, pid_t pid, int value)
 {
     struct iod_cmd iod;
-    char *ptr = (char*)&iod;
-    int count, err, size = sizeof(struct iod_cmd);
     
     iod.cmd = cmd;
     iod.pid = pid;
     iod.value = value;
     
-    while((count = send(neobox.iod.sock, ptr, size, 0)) != size)
+    return neobox_iod_send(&iod, sizeof(struct iod_cmd), -1);
+}
+
+int neobox_iod_region()
+{
+    struct iod_cmd_region iod;
+    
+    iod.cmd.cmd = IOD_CMD_REGION;
+    iod.cmd.pid = 0;
+    iod.cmd.value = neobox.iod.z;
+    iod.region = neobox.iod.region;
+    
+    return neobox_iod_send(&iod, sizeof(struct iod_cmd_region), -1);
+}
+
+int neobox_iod_topic(const char *topic, int subscribe)
+{
+    struct iod_cmd_message iod;
+    
+    memset(&iod, 0, sizeof(iod));
+    iod.cmd.cmd = IOD_CMD_TOPIC;
+    iod.cmd.value = subscribe ? IOD_TOPIC_SUBSCRIBE : 0;
+    strncpy(iod.message.topic, topic, IOD_TOPIC_SIZE-1);
+    
+    // only the topic is needed
+    return neobox_iod_send(&iod, sizeof(struct iod_cmd)+IOD_TOPIC_SIZE, -1);
+}
+
+// message of an IOD_EVENT_MESSAGE record, queued until the event is parsed
+void neobox_iod_message(const char *record, int size)
+{
+    struct neobox_chain_message *cm = calloc(1, sizeof(struct neobox_chain_message));
+    
+    // records without message leave it empty
+    size -= sizeof(struct iod_tevent);
+    if(size > 0)
+        memcpy(&cm->message, record+sizeof(struct iod_tevent),
+            size < sizeof(struct iod_message) ? size : sizeof(struct iod_message));
+    cm->fd = -1;
+    
+    // fds are received in order with their messages
+    if(cm->message.flags & IOD_MESSAGE_SHM)
     {
-        if(count == -1)
+        if(neobox.iod.message_nfds)
         {
-            if((err = errno) == EINTR)
-                continue;
-            neobox_perror(1, "Failed to send iod cmd");
-            return err;
+            cm->fd = neobox.iod.message_fds[0];
+            memmove(neobox.iod.message_fds, neobox.iod.message_fds+1,
+                --neobox.iod.message_nfds*sizeof(int));
+        }
+        else
+            cm->message.size = 0;
+    }
+    else if(cm->message.size > IOD_MESSAGE_SIZE)
+        cm->message.size = IOD_MESSAGE_SIZE;
+    
+    CIRCLEQ_INSERT_TAIL(&neobox.iod.messages, cm, chain);
+}
+
+void neobox_iod_message_done()
+{
+    struct neobox_chain_message *cm = neobox.iod.message;
+    
+    if(!cm)
+        return;
+    
+    if(neobox.iod.message_map)
+        munmap(neobox.iod.message_map, cm->message.size);
+    if(cm->fd != -1)
+        close(cm->fd);
+    free(cm);
+    
+    neobox.iod.message = 0;
+    neobox.iod.message_map = 0;
+}
+
+int neobox_iod_buffered()
+{
+    struct iod_frame frame;
+    int avail = neobox.iod.in_size-neobox.iod.in_pos;
+    
+    if(neobox.iod.version < 2)
+        return avail >= sizeof(struct iod_event);
+    if(neobox.iod.in_left)
+        return avail >= neobox.iod.in_rsize;
+    if(avail < sizeof(struct iod_frame))
+        return 0;
+    
+    memcpy(&frame, neobox.iod.in+neobox.iod.in_pos, sizeof(struct iod_frame));
+    
+    // broken frames are reported by unbuffer
+    return !frame.count || frame.size % frame.count
+        || avail >= sizeof(struct iod_frame)+frame.size/frame.count;
+}
+
+// returns -1 if incomplete, EPROTO on broken frame
+int neobox_iod_unbuffer(struct iod_tevent *event)
+{
+    struct iod_frame frame;
+    char *record;
+    int size;
+    
+    if(!neobox_iod_buffered())
+        return -1;
+    
+    if(neobox.iod.version > 1 && !neobox.iod.in_left)
+    {
+        memcpy(&frame, neobox.iod.in+neobox.iod.in_pos, sizeof(struct iod_frame));
+        if(!frame.count || frame.size % frame.count
+            || frame.size/frame.count < sizeof(struct iod_event)
+            || frame.size/frame.count > IOD_BUFFER/2)
+        {
+            neobox_printf(1, "Broken iod frame\n");
+            return EPROTO;
+        }
+        neobox.iod.in_pos += sizeof(struct iod_frame);
+        neobox.iod.in_left = frame.count;
+        neobox.iod.in_rsize = frame.size/frame.count;
+        if(!neobox_iod_buffered())
+            return -1;
+    }
+    
+    size = neobox.iod.version > 1 ? neobox.iod.in_rsize : sizeof(struct iod_event);
+    record = neobox.iod.in+neobox.iod.in_pos;
+    
+    // v1 events and older records leave the rest zeroed
+    memset(event, 0, sizeof(struct iod_tevent));
+    memcpy(event, record,
+        size < sizeof(struct iod_tevent) ? size : sizeof(struct iod_tevent));
+    neobox.iod.in_pos += size;
+    neobox.iod.received++;
+    if(neobox.iod.version > 1)
+        neobox.iod.in_left--;
+    
+    switch(event->event)
+    {
+    case IOD_EVENT_HELLO:
+        // following events use the accepted version
+        if(neobox.iod.hello)
+        {
+            neobox.iod.version = event->value.status;
+            neobox.iod.hello = 0;
+            neobox_printf(1, "iod protocol v%i\n", neobox.iod.version);
+        }
+        break;
+    case IOD_EVENT_RING:
+        // attach in order with the buffered events
+        if(neobox.iod.ring_shm)
+        {
+            neobox_iod_ring_attach(neobox.iod.ring_shm, neobox.iod.ring_efd);
+            neobox.iod.ring_shm = neobox.iod.ring_efd = 0;
         }
-        ptr += count;
-        size -= count;
+        break;
+    case IOD_EVENT_MESSAGE:
+        neobox_iod_message(record, size);
+        break;
     }
     
     return 0;
 }
 
-int neobox_iod_recv(struct iod_event *event)
+int neobox_iod_recv_sock(struct iod_tevent *event, int flags)
 {
-    char *ptr = (char*)event;
-    int count, err, size = sizeof(struct iod_event);
+    char cbuf[CMSG_SPACE(2*sizeof(int))];
+    struct iovec iov;
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct cmsghdr *cmsg;
+    int count, err;
     
-    while((count = recv(neobox.iod.sock, ptr, size, 0)) != size)
-        switch(count)
+    while((err = neobox_iod_unbuffer(event)))
+    {
+        if(err != -1)
+            return err;
+        
+        // keep unhandled bytes at the start
+        if(neobox.iod.in_pos)
+        {
+            memmove(neobox.iod.in, neobox.iod.in+neobox.iod.in_pos,
+                neobox.iod.in_size-neobox.iod.in_pos);
+            neobox.iod.in_size -= neobox.iod.in_pos;
+            neobox.iod.in_pos = 0;
+        }
+        
+        iov.iov_base = neobox.iod.in+neobox.iod.in_size;
+        iov.iov_len = IOD_BUFFER-neobox.iod.in_size;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        
+        switch((count = recvmsg(neobox.iod.sock, &msg, MSG_CMSG_CLOEXEC|flags)))
         {
         case 0:
             neobox_perror(1, "Failed to recv iod event");
@@ -431,45 +732,305 @@ int neobox_iod_recv(struct iod_event *event)
         case -1:
             if((err = errno) == EINTR)
                 continue;
+            if((err == EAGAIN || err == EWOULDBLOCK) && flags & MSG_DONTWAIT)
+                return -1;
             neobox_perror(1, "Failed to recv iod event");
             return err;
         default:
-            ptr += count;
-            size -= count;
+            // ring fds come along with the ring event
+            cmsg = CMSG_FIRSTHDR(&msg);
+            if(cmsg && cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(2*sizeof(int)))
+            {
+                neobox_iod_ring_drop();
+                neobox.iod.ring_shm = ((int*)CMSG_DATA(cmsg))[0];
+                neobox.iod.ring_efd = ((int*)CMSG_DATA(cmsg))[1];
+            }
+            // message shared memory comes along with the message
+            else if(cmsg && cmsg->cmsg_level == SOL_SOCKET
+                && cmsg->cmsg_type == SCM_RIGHTS
+                && cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            {
+                if(neobox.iod.message_nfds < MESSAGE_FDS)
+                    neobox.iod.message_fds[neobox.iod.message_nfds++] = *(int*)CMSG_DATA(cmsg);
+                else
+                    close(*(int*)CMSG_DATA(cmsg));
+            }
+            neobox.iod.in_size += count;
+            // rest of a partial event is on its way
+            flags &= ~MSG_DONTWAIT;
         }
+    }
     
     return 0;
 }
 
-void neobox_iod_reconnect()
+int neobox_iod_hello()
 {
-    while(1)
+    struct iod_tevent event;
+    int err;
+    
+    // v1 iod starts with (de)activate instead of a version offer
+    if((err = neobox_iod_recv_sock(&event, 0)))
+        return err;
+    
+    if(event.event != IOD_EVENT_HELLO || event.value.status < 2)
     {
-        neobox_iod_connect(-1);
-        
-        if(neobox_iod_cmd(IOD_CMD_REGISTER, getpid(), 0))
-            continue;
-        if(neobox.iod.lock)
-            if(neobox_iod_cmd(IOD_CMD_LOCK, 0, 1))
-                continue;
-        if(neobox.iod.hide)
-            if(neobox_iod_cmd(IOD_CMD_HIDE, 0, IOD_HIDE_MASK|neobox.iod.priority))
-                continue;
-        if(neobox.iod.grab & NEOBOX_BUTTON_AUX)
-        {
-            if(neobox_iod_cmd(IOD_CMD_GRAB, 0, IOD_GRAB_MASK|IOD_GRAB_AUX))
-                continue;
-        }
-        else if(neobox.iod.grab & NEOBOX_BUTTON_POWER)
-            if(neobox_iod_cmd(IOD_CMD_GRAB, 0, IOD_GRAB_MASK|IOD_GRAB_POWER))
-                continue;
-        break;
+        if(event.event != IOD_EVENT_HELLO)
+            neobox_queue_event(STASH_IOD, &event);
+        neobox_printf(1, "iod protocol v1\n");
+        return 0;
     }
-}
-
-struct neobox_options neobox_args(int *argc, char *argv[], struct neobox_options options)
-{
-    struct option fboption[] =
+    
+    if((err = neobox_iod_cmd(IOD_CMD_HELLO, 0, IOD_VERSION |
+        (neobox.options & NEOBOX_OPTION_RING ? IOD_HELLO_RING : 0))))
+    {
+        return err;
+    }
+    
+    // events until the ack are still v1
+    neobox.iod.hello = 1;
+    while(neobox.iod.hello)
+    {
+        if((err = neobox_iod_recv_sock(&event, 0)))
+            return err;
+        if(event.event != IOD_EVENT_HELLO)
+            neobox_queue_event(STASH_IOD, &event);
+    }
+    
+    return 0;
+}
+
+int neobox_iod_connect(int tries)
+{
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    int reuse = 1;
+    
+    neobox_printf(1, "Connecting to iod socket\n");
+    
+    neobox_iod_ring_detach();
+    neobox_iod_ring_drop();
+    
+    if(!neobox.iod.epfd && (neobox.iod.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+    {
+        neobox_perror(1, "Failed to create iod epoll");
+        neobox.iod.epfd = 0;
+        return NEOBOX_ERROR_IOD_OPEN;
+    }
+    
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, neobox.iod.usock, UNIX_PATH_MAX);
+    
+    while(1)
+    {
+        if(neobox.iod.sock)
+            while(close(neobox.iod.sock) == -1 && errno == EINTR);
+        
+        if((neobox.iod.sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        {
+            neobox_perror(1, "Failed to open iod socket");
+            goto retry;
+        }
+        
+        if(setsockopt(neobox.iod.sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) == -1)
+        {
+            neobox_perror(1, "Failed to set SO_REUSEADDR");
+            goto retry;
+        }
+        
+        while(connect(neobox.iod.sock, (struct sockaddr*)&addr, sizeof(struct sockaddr_un)) == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            neobox_perror(1, "Failed to connect iod socket");
+            goto retry;
+        }
+        
+        ev.events = EPOLLIN;
+        ev.data.fd = neobox.iod.sock;
+        if(epoll_ctl(neobox.iod.epfd, EPOLL_CTL_ADD, neobox.iod.sock, &ev) == -1)
+        {
+            neobox_perror(1, "Failed to poll iod socket");
+            goto retry;
+        }
+        
+        neobox.iod.version = 1;
+        neobox.iod.hello = 0;
+        neobox.iod.in_size = neobox.iod.in_pos = neobox.iod.in_left = 0;
+        neobox.iod.ahead = 0;
+        
+        if(neobox_iod_hello())
+            goto retry;
+        
+        break;
+        
+retry:  if(tries-- == 1)
+        {
+            neobox_perror(1, "Unable to connect iod socket");
+            return NEOBOX_ERROR_IOD_OPEN;
+        }
+        
+        neobox_printf(1, "Retry connecting to iod socket in 1 second\n");
+        
+        while(sleep(1));
+    }
+    
+    return 0;
+}
+
+int neobox_iod_poll(struct iod_tevent *event)
+{
+    if(neobox.iod.ahead)
+    {
+        *event = neobox.iod.next;
+        neobox.iod.ahead = 0;
+        return 0;
+    }
+    
+    // socket events before the ring event come first
+    if(!neobox_iod_buffered() && !neobox_iod_ring_pop(event))
+        return 0;
+    
+    return neobox_iod_recv_sock(event, MSG_DONTWAIT);
+}
+
+// replaces MOVED by following MOVED already received, reads one ahead
+void neobox_iod_collapse(struct iod_tevent *event)
+{
+    while(event->event == IOD_EVENT_MOVED && !neobox.iod.ahead)
+    {
+        // broken frames are reported by the next poll
+        if(neobox_iod_buffered() ? neobox_iod_unbuffer(&neobox.iod.next)
+            : neobox_iod_ring_pop(&neobox.iod.next))
+            return;
+        
+        if(neobox.iod.next.event != IOD_EVENT_MOVED)
+            neobox.iod.ahead = 1;
+        else
+            *event = neobox.iod.next;
+    }
+}
+
+int neobox_iod_pending()
+{
+    if(neobox.iod.ahead || neobox_iod_buffered())
+        return 1;
+    
+    // announces sleep if nothing is pending
+    return neobox.iod.ring && iod_ring_sleep(neobox.iod.ring);
+}
+
+int neobox_iod_recv(struct iod_tevent *event)
+{
+    struct pollfd pfds[2];
+    int err;
+    
+    if(neobox.iod.ahead)
+    {
+        *event = neobox.iod.next;
+        neobox.iod.ahead = 0;
+        return 0;
+    }
+    
+    if(!neobox.iod.ring || neobox_iod_buffered())
+        return neobox_iod_recv_sock(event, 0);
+    
+    pfds[0].fd = neobox.iod.sock;
+    pfds[0].events = POLLIN;
+    pfds[1].events = POLLIN;
+    
+    while(1)
+    {
+        if(!neobox_iod_ring_pop(event))
+            return 0;
+        if(!neobox.iod.ring)
+            return neobox_iod_recv_sock(event, 0);
+        if(iod_ring_sleep(neobox.iod.ring))
+            continue;
+        
+        pfds[1].fd = neobox.iod.ring_fd;
+        
+        if(poll(pfds, 2, -1) == -1)
+        {
+            if((err = errno) == EINTR)
+                continue;
+            neobox_perror(1, "Failed to poll iod event");
+            return err;
+        }
+        
+        iod_ring_wake(neobox.iod.ring);
+        eventfd_read(neobox.iod.ring_fd, &(eventfd_t){0});
+        
+        if(pfds[0].revents)
+            return neobox_iod_recv_sock(event, 0);
+    }
+}
+
+int neobox_iod_register()
+{
+    // v2 clients are registered on connect
+    if(neobox.iod.version > 1)
+        return 0;
+    
+    return neobox_iod_cmd(IOD_CMD_REGISTER, getpid(),
+        neobox.options & NEOBOX_OPTION_RING ? IOD_REGISTER_RING : 0);
+}
+
+void neobox_iod_reconnect()
+{
+    int i;
+    
+    while(1)
+    {
+        neobox_iod_connect(-1);
+        
+        // replies of the old connection are lost
+        neobox.iod.lock_requests = 0;
+        neobox.iod.grab_requests[0] = neobox.iod.grab_requests[1] = 0;
+        
+        if(neobox_iod_register())
+            continue;
+        if(neobox.iod.lock)
+        {
+            if(neobox_iod_cmd(IOD_CMD_LOCK, 0, 1))
+                continue;
+            neobox.iod.lock_requests++;
+        }
+        if(neobox.iod.hide)
+            if(neobox_iod_cmd(IOD_CMD_HIDE, 0, IOD_HIDE_MASK|neobox.iod.priority))
+                continue;
+        if(neobox.iod.grab & NEOBOX_BUTTON_AUX)
+        {
+            if(neobox_iod_cmd(IOD_CMD_GRAB, 0, IOD_GRAB_MASK|IOD_GRAB_AUX))
+                continue;
+            neobox.iod.grab_requests[GRAB_INDEX(NEOBOX_BUTTON_AUX)]++;
+        }
+        else if(neobox.iod.grab & NEOBOX_BUTTON_POWER)
+        {
+            if(neobox_iod_cmd(IOD_CMD_GRAB, 0, IOD_GRAB_MASK|IOD_GRAB_POWER))
+                continue;
+            neobox.iod.grab_requests[GRAB_INDEX(NEOBOX_BUTTON_POWER)]++;
+        }
+        if(neobox.iod.classes != IOD_CLASS_DEFAULT)
+            if(neobox_iod_cmd(IOD_CMD_SUBSCRIBE, 0, neobox.iod.classes))
+                continue;
+        if(neobox.iod.region.height && neobox.iod.version > 1)
+            if(neobox_iod_region())
+                continue;
+        for(i=0; i<TOPICS && neobox.iod.version > 1; i++)
+            if(neobox.iod.topics[i][0] && neobox_iod_topic(neobox.iod.topics[i], 1))
+                break;
+        if(i < TOPICS && neobox.iod.version > 1)
+            continue;
+        break;
+    }
+}
+
+struct neobox_options neobox_args(int *argc, char *argv[], struct neobox_options options)
+{
+    struct option fboption[] =
     {
         { "neobox-fb", 1, 0, 'f' },      // path to framebuffer
         { "neobox-iod", 1, 0, 't' },     // path to iod socket
@@ -478,6 +1039,10 @@ struct neobox_options neobox_args(int *argc, char *argv[], struct neobox_options
         { "neobox-config", 1, 0, 'c' },  // config path
         { "neobox-print", 1, 0, 'p'},    // n: no print, f: force print
         { "neobox-name", 1, 0, 'n'},     // app name
+        { "neobox-ring", 1, 0, 'g'},     // y: shared event ring, n: socket only
+        { "neobox-profile", 1, 0, 'l'},  // y: latency histograms, n: none
+        { "neobox-realtime", 1, 0, 'e'}, // y: SCHED_FIFO while active, n: normal, iod -R prio
+        { "neobox-cpu", 1, 0, 'u'},      // pin to cpu
         {0, 0, 0, 0}
     };
     int opt, x, y;
@@ -519,6 +1084,30 @@ struct neobox_options neobox_args(int *argc, char *argv[], struct neobox_options
         case 'n':
             options.appname = optarg;
             break;
+        case 'g':
+            options.options &= ~NEOBOX_OPTION_RING;
+            if(optarg[0] == 'y')
+                options.options |= NEOBOX_OPTION_RING;
+            break;
+        case 'l':
+            options.options &= ~NEOBOX_OPTION_PROFILE;
+            if(optarg[0] == 'y')
+                options.options |= NEOBOX_OPTION_PROFILE;
+            break;
+        case 'e':
+            options.options &= ~NEOBOX_OPTION_REALTIME;
+            if(optarg[0] == 'y')
+                options.options |= NEOBOX_OPTION_REALTIME;
+            // iod runs with another priority than suggested
+            else if(atoi(optarg) > 0)
+            {
+                options.options |= NEOBOX_OPTION_REALTIME;
+                options.realtime = atoi(optarg);
+            }
+            break;
+        case 'u':
+            options.cpu = atoi(optarg);
+            break;
         default:
             continue;
         }
@@ -578,10 +1167,289 @@ void neobox_init_screen()
     SIMV(send(neobox.fb.sock, &sim_tmp, 1, 0));
 }
 
+long long neobox_timer_now()
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    
+    return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+
+void neobox_timer_swap(int a, int b)
+{
+    struct neobox_timer_entry *heap = neobox.timer.heap;
+    struct neobox_timer_entry tmp = heap[a];
+    
+    heap[a] = heap[b];
+    heap[b] = tmp;
+    neobox.timer.pos[heap[a].type][heap[a].id] = a;
+    neobox.timer.pos[heap[b].type][heap[b].id] = b;
+}
+
+void neobox_timer_sift(int i)
+{
+    struct neobox_timer_entry *heap = neobox.timer.heap;
+    int child;
+    
+    while(i && heap[i].deadline < heap[(i-1)/2].deadline)
+    {
+        neobox_timer_swap(i, (i-1)/2);
+        i = (i-1)/2;
+    }
+    
+    while((child = 2*i+1) < neobox.timer.count)
+    {
+        if(child+1 < neobox.timer.count && heap[child+1].deadline < heap[child].deadline)
+            child++;
+        if(heap[i].deadline <= heap[child].deadline)
+            break;
+        neobox_timer_swap(i, child);
+        i = child;
+    }
+}
+
+void neobox_timer_delete(int i)
+{
+    struct neobox_timer_entry *heap = neobox.timer.heap;
+    
+    neobox.timer.pos[heap[i].type][heap[i].id] = -1;
+    
+    if(i != --neobox.timer.count)
+    {
+        heap[i] = heap[neobox.timer.count];
+        neobox.timer.pos[heap[i].type][heap[i].id] = i;
+        neobox_timer_sift(i);
+    }
+    
+    if(!neobox.timer.count)
+        neobox.timer.slack = 0;
+}
+
+int neobox_timer_arm()
+{
+    struct itimerspec its;
+    long long deadline = neobox.timer.count ? neobox.timer.heap[0].deadline : 0;
+    
+    if(deadline == neobox.timer.armed)
+        return 0;
+    
+    // zero disarms
+    its.it_interval.tv_sec = its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = deadline/1000000;
+    its.it_value.tv_nsec = deadline%1000000*1000;
+    
+    if(timerfd_settime(neobox.timer.fd, TFD_TIMER_ABSTIME, &its, 0) == -1)
+    {
+        neobox_perror(1, "Failed to set timer");
+        return -1;
+    }
+    
+    neobox.timer.armed = deadline;
+    
+    return 0;
+}
+
+// sets or resets timer id, period and slack in ms
+int neobox_add_timer(unsigned char id, unsigned char type, unsigned int msec,
+    unsigned int period, unsigned int slack)
+{
+    struct neobox_timer_entry *timer;
+    int i = neobox.timer.pos[type][id];
+    
+    if(type == TIMER_USER)
+        neobox_printf(1, "add timer %i [%u.%u]\n", id, msec/1000, msec%1000);
+    
+    if(i == -1)
+    {
+        i = neobox.timer.count++;
+        neobox.timer.pos[type][id] = i;
+    }
+    
+    timer = &neobox.timer.heap[i];
+    timer->id = id;
+    timer->type = type;
+    timer->expire = neobox_timer_now() + msec*1000LL;
+    timer->deadline = timer->expire + slack*1000LL;
+    timer->period = period*1000;
+    
+    if(slack*1000LL > neobox.timer.slack)
+        neobox.timer.slack = slack*1000LL;
+    
+    neobox_timer_sift(i);
+    
+    if(neobox_timer_arm())
+    {
+        neobox_timer_delete(neobox.timer.pos[type][id]);
+        return -1;
+    }
+    
+    return 0;
+}
+
+void neobox_remove_timer(unsigned char id, unsigned char type)
+{
+    if(neobox.timer.pos[type][id] == -1)
+        return;
+    
+    neobox_timer_delete(neobox.timer.pos[type][id]);
+    neobox_timer_arm();
+}
+
+void neobox_timer_fire(struct neobox_timer_entry *timer)
+{
+    struct neobox_stash stash;
+    int button;
+    
+    stash.type = STASH_NEOBOX;
+    stash.event.neobox.id = timer->id;
+    
+    if(timer->type == TIMER_SYSTEM)
+    {
+        switch(timer->id)
+        {
+        case TIMER_PAUSE:
+            neobox.pause = 0;
+            return;
+        case TIMER_WAKE:
+            stash.event.neobox.type = NEOBOX_EVENT_WAKE;
+            break;
+        case TIMER_LOCK:
+            if(!neobox.iod.lock_pending)
+                return;
+            neobox_printf(1, "%s timeout\n", neobox.iod.lock ? "lock" : "unlock");
+            neobox.iod.lock_pending = 0;
+            stash.event.neobox.type = NEOBOX_EVENT_LOCK;
+            stash.event.neobox.id = neobox.iod.lock;
+            stash.event.neobox.value.i = NEOBOX_SET_TIMEOUT;
+            break;
+        default: // TIMER_GRAB+GRAB_INDEX(button)
+            button = timer->id-TIMER_GRAB+1;
+            if(!(neobox.iod.grab_pending & button))
+                return;
+            neobox_printf(1, "%s timeout\n", neobox.iod.grab & button ? "grab" : "ungrab");
+            neobox.iod.grab_pending &= ~button;
+            stash.event.neobox.type = NEOBOX_EVENT_GRAB;
+            stash.event.neobox.id = button;
+            stash.event.neobox.value.i = NEOBOX_SET_TIMEOUT;
+            break;
+        }
+    }
+    else
+    {
+        neobox_printf(1, "timer %i event\n", timer->id);
+        stash.event.neobox.type = NEOBOX_EVENT_TIMER;
+    }
+    
+    if(neobox_queue_push(&stash))
+        neobox_printf(1, "Event queue full, timer %i dropped\n", timer->id);
+}
+
+void neobox_read_timers()
+{
+    struct neobox_timer_entry *heap = neobox.timer.heap;
+    struct neobox_timer_entry fired[TIMERS];
+    short stack[TIMERS];
+    long long now = neobox_timer_now();
+    int i, j, count = 0, top = 0;
+    
+    read(neobox.timer.fd, &(uint64_t){0}, sizeof(uint64_t));
+    neobox.timer.armed = 0;
+    
+    // collect expired timers, deadlines later than now plus the largest
+    // slack cannot have expired and end the search
+    if(neobox.timer.count)
+        stack[top++] = 0;
+    while(top)
+    {
+        i = stack[--top];
+        if(heap[i].deadline > now + neobox.timer.slack)
+            continue;
+        if(heap[i].expire <= now)
+        {
+            // in expiry order
+            for(j=count++; j && fired[j-1].expire > heap[i].expire; j--)
+                fired[j] = fired[j-1];
+            fired[j] = heap[i];
+        }
+        if(2*i+1 < neobox.timer.count)
+            stack[top++] = 2*i+1;
+        if(2*i+2 < neobox.timer.count)
+            stack[top++] = 2*i+2;
+    }
+    
+    for(i=0; i<count; i++)
+    {
+        j = neobox.timer.pos[fired[i].type][fired[i].id];
+        
+        if(!fired[i].period)
+            neobox_timer_delete(j);
+        else
+        {
+            // skip missed periods instead of firing them all at once
+            heap[j].expire += ((now-heap[j].expire)/heap[j].period+1)*heap[j].period;
+            heap[j].deadline = heap[j].expire + (fired[i].deadline-fired[i].expire);
+            neobox_timer_sift(j);
+        }
+        
+        neobox_timer_fire(&fired[i]);
+    }
+    
+    neobox_timer_arm();
+}
+
+int neobox_init_timer()
+{
+    struct epoll_event ev;
+    
+    neobox.timer.count = 0;
+    neobox.timer.armed = neobox.timer.slack = 0;
+    memset(neobox.timer.pos, -1, sizeof(neobox.timer.pos));
+    // no slack unless asked for with neobox_timer_slack
+    memset(neobox.timer.slacks, 0, sizeof(neobox.timer.slacks));
+    
+    if((neobox.timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) == -1)
+    {
+        neobox_perror(1, "Failed to open timer");
+        return NEOBOX_ERROR_TIMER;
+    }
+    
+    ev.events = EPOLLIN;
+    ev.data.fd = neobox.timer.fd;
+    if(epoll_ctl(neobox.iod.epfd, EPOLL_CTL_ADD, neobox.timer.fd, &ev) == -1)
+    {
+        neobox_perror(1, "Failed to poll timer");
+        return NEOBOX_ERROR_TIMER;
+    }
+    
+    return 0;
+}
+
+int neobox_init_queue()
+{
+    int i;
+    
+    neobox.queue.head = neobox.queue.tail = neobox.queue.dropped = 0;
+    for(i=0; i<QUEUE_SIZE; i++)
+        neobox.queue.slots[i].seq = i;
+    
+    neobox.signal_fd = -1;
+    sigemptyset(&neobox.signals);
+    
+    if((neobox.queue_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+    {
+        neobox_perror(1, "Failed to open event queue doorbell");
+        return NEOBOX_ERROR_SIGNAL;
+    }
+    
+    return 0;
+}
+
 int neobox_init_custom(struct neobox_options options)
 {
     int ret;
     struct sigaction sa;
+    struct epoll_event ev;
     SIMV(struct sockaddr_un addr);
     
     neobox.appname = options.appname;
@@ -600,16 +1468,58 @@ int neobox_init_custom(struct neobox_options options)
         "normal");
     neobox_printf(1, "  adminmap: %s\n",
         options.options & NEOBOX_OPTION_ADMINMAP ? "enabled" : "disabled");
+    neobox_printf(1, "  ring: %s\n",
+        options.options & NEOBOX_OPTION_RING ? "enabled" : "disabled");
+    neobox_printf(1, "  profile: %s\n",
+        options.options & NEOBOX_OPTION_PROFILE ? "enabled" : "disabled");
+    neobox_printf(1, "  realtime: %s\n",
+        options.options & NEOBOX_OPTION_REALTIME ? "enabled" : "disabled");
+    if(options.options & NEOBOX_OPTION_REALTIME)
+        neobox_printf(1, "  iod priority: %i\n", options.realtime);
+    if(options.cpu >= 0)
+        neobox_printf(1, "  cpu: %i\n", options.cpu);
     
     neobox.iod.usock = options.iod;
     neobox.iod.sock = 0;
+    neobox.iod.epfd = 0;
+    neobox.iod.ring = 0;
+    neobox.iod.ring_shm = neobox.iod.ring_efd = 0;
+    neobox.iod.classes = IOD_CLASS_DEFAULT;
+    neobox.iod.message = 0;
+    neobox.iod.message_map = 0;
+    neobox.iod.message_nfds = 0;
+    neobox.iod.received = neobox.iod.dispatched = 0;
+    neobox.iod.lock = neobox.iod.grab = 0;
+    neobox.iod.lock_pending = neobox.iod.grab_pending = 0;
+    neobox.iod.lock_requests = 0;
+    neobox.iod.grab_requests[0] = neobox.iod.grab_requests[1] = 0;
+    CIRCLEQ_INIT(&neobox.iod.messages);
+    LIST_INIT(&neobox.watches);
+    neobox.options = options.options;
+    // below iod, else the app would preempt its own input
+    neobox.realtime = options.realtime > IOD_RT_BELOW ? options.realtime-IOD_RT_BELOW : 1;
+    
+    // events before the HELLO ack are stashed
+    if((ret = neobox_init_queue()))
+        return ret;
     
     // open iod socket
     if((ret = neobox_iod_connect(-1)))
         return ret;
     
-    // register
-    if(neobox_iod_cmd(IOD_CMD_REGISTER, getpid(), 0))
+    ev.events = EPOLLIN;
+    ev.data.fd = neobox.queue_fd;
+    if(epoll_ctl(neobox.iod.epfd, EPOLL_CTL_ADD, neobox.queue_fd, &ev) == -1)
+    {
+        neobox_perror(1, "Failed to poll event queue");
+        return NEOBOX_ERROR_SIGNAL;
+    }
+    
+    if((ret = neobox_init_timer()))
+        return ret;
+    
+    // register v1, ring is attached when iod sends it
+    if(neobox_iod_register())
         return NEOBOX_ERROR_REGISTER;
     
     // open framebuffer
@@ -689,6 +1599,17 @@ int neobox_init_custom(struct neobox_options options)
         return NEOBOX_ERROR_FB_MMAP;
     }
     
+    // best effort, without privileges the app runs normally
+    if(options.cpu >= 0 && iod_rt_affinity(options.cpu) == -1)
+        neobox_perror(1, "Failed to pin cpu");
+    if(options.options & NEOBOX_OPTION_REALTIME)
+    {
+        // first draw must not fault, MCL_FUTURE covers later allocations
+        iod_rt_prefault(neobox.fb.ptr, neobox.fb.size);
+        if(iod_rt_lock() == -1)
+            neobox_perror(1, "Failed to lock memory");
+    }
+    
     neobox.fb.ptr += neobox.fb.vinfo.xoffset*neobox.fb.bpp
                   + neobox.fb.vinfo.yoffset*neobox.fb.finfo.line_length;
     
@@ -727,31 +1648,38 @@ int neobox_init_custom(struct neobox_options options)
     neobox.pause = 0;
     neobox.filter_fun = 0;
     neobox.flagstat = calloc(sizeof(char), neobox.layout.size);
-    CIRCLEQ_INIT(&neobox.queue);
-    CIRCLEQ_INIT(&neobox.timer);
     
     // signals
     sa.sa_handler = neobox_signal_handler;
     sigfillset(&sa.sa_mask);
     
-    sa.sa_flags = SA_RESTART;
-    if(sigaction(SIGALRM, &sa, 0) == -1)
-    {
-        neobox_perror(1, "Failed to catch SIGARLM");
-        return NEOBOX_ERROR_SIGNAL;
-    }
-    
     sa.sa_flags = 0;
     if(sigaction(SIGINT, &sa, 0) == -1)
     {
         neobox_perror(1, "Failed to catch SIGINT");
         return NEOBOX_ERROR_SIGNAL;
     }
+    if((ret = neobox_signal_fd(SIGINT)))
+        return ret;
+    
+    // histograms are printed on deferred SIGUSR1
+    memset(&neobox.profile, 0, sizeof(struct neobox_profile));
+    if(neobox.options & NEOBOX_OPTION_PROFILE)
+    {
+        sa.sa_flags = SA_RESTART;
+        if(sigaction(SIGUSR1, &sa, 0) == -1)
+        {
+            neobox_perror(1, "Failed to catch SIGUSR1");
+            return NEOBOX_ERROR_SIGNAL;
+        }
+        if((ret = neobox_signal_fd(SIGUSR1)))
+            return ret;
+    }
     
     neobox_printf(1, "init done\n");
     
-    // return socket for manual polling
-    return neobox.iod.sock;
+    // return iod epoll for manual polling
+    return neobox.iod.epfd;
 }
 
 struct neobox_options neobox_options_default(int *argc, char *argv[])
@@ -763,9 +1691,11 @@ struct neobox_options neobox_options_default(int *argc, char *argv[])
     options.config = NEOBOX_CONFIG_DEFAULT;
     options.layout = tkbLayoutDefault;
     options.format = NEOBOX_FORMAT_LANDSCAPE;
-    options.options = NEOBOX_OPTION_NORM_PRINT;
+    options.options = NEOBOX_OPTION_NORM_PRINT|NEOBOX_OPTION_RING;
     options.verbose = 0;
     options.map = NEOBOX_MAP_DEFAULT;
+    options.cpu = -1;
+    options.realtime = IOD_RT_PRIO;
     options.appname = basename(argv[0]);
     
     return neobox_args(argc, argv, options);
@@ -791,14 +1721,20 @@ void neobox_finish()
     struct neobox_save *save;
     const struct neobox_mapelem *elem;
     const struct neobox_map *map;
-    struct neobox_chain_queue *cq;
-    struct neobox_chain_timer *ct;
+    struct neobox_chain_message *cm;
     sigset_t set;
     
     neobox_printf(1, "[NEOBOX] finish\n");
     
+    if(neobox.options & NEOBOX_OPTION_PROFILE)
+        neobox_profile_print();
+    
     neobox_iod_cmd(IOD_CMD_REMOVE, 0, 0);
+    neobox_iod_ring_detach();
+    while(neobox.watches.lh_first)
+        neobox_unwatch_fd(neobox.watches.lh_first->fd);
     close(neobox.iod.sock);
+    close(neobox.iod.epfd);
     
     close(neobox.fb.fd);
     SIMV(close(neobox.fb.sock));
@@ -836,155 +1772,72 @@ void neobox_finish()
     sigfillset(&set);
     sigprocmask(SIG_BLOCK, &set, 0);
     
-    while((cq = neobox.queue.cqh_first) != (void*)&neobox.queue)
-    {
-        CIRCLEQ_REMOVE(&neobox.queue, cq, chain);
-        free(cq);
-    }
-    while((ct = neobox.timer.cqh_first) != (void*)&neobox.timer)
+    if(neobox.queue.dropped)
+        neobox_printf(1, "Event queue dropped %u events\n", neobox.queue.dropped);
+    close(neobox.queue_fd);
+    if(neobox.signal_fd != -1)
+        close(neobox.signal_fd);
+    close(neobox.timer.fd);
+    
+    neobox_iod_message_done();
+    while((cm = neobox.iod.messages.cqh_first) != (void*)&neobox.iod.messages)
     {
-        CIRCLEQ_REMOVE(&neobox.timer, ct, chain);
-        free(ct);
+        CIRCLEQ_REMOVE(&neobox.iod.messages, cm, chain);
+        if(cm->fd != -1)
+            close(cm->fd);
+        free(cm);
     }
+    while(neobox.iod.message_nfds)
+        close(neobox.iod.message_fds[--neobox.iod.message_nfds]);
 }
 
-int neobox_add_timer(unsigned char id, unsigned char type, unsigned int sec, unsigned int msec)
+long long neobox_profile_now()
 {
-    struct neobox_chain_timer *ct;
-    struct neobox_chain_timer *nct = malloc(sizeof(struct neobox_chain_timer));
-    struct timeval *tv = &nct->tv;
-    struct itimerval it;
-    sigset_t set, oldset;
-    
-    nct->id = id;
-    nct->type = type;
-    gettimeofday(tv, 0);
-    sigfillset(&set);
-    
-    sec += msec/1000;
-    msec %= 1000;
-    
-    tv->tv_sec += sec;
-    tv->tv_sec += (tv->tv_usec+msec*1000)/1000000;
-    tv->tv_usec = (tv->tv_usec+msec*1000)%1000000;
-    
-    sigprocmask(SIG_BLOCK, &set, &oldset);
-    
-    if(type == TIMER_USER)
-        neobox_printf(1, "add timer %i [%u.%u]\n", id, sec, msec);
-    
-    ct = neobox.timer.cqh_first;
-    
-    while(ct != (void*)&neobox.timer &&
-        (tv->tv_sec > ct->tv.tv_sec ||
-        (tv->tv_sec == ct->tv.tv_sec && tv->tv_usec >= ct->tv.tv_usec)))
-    {
-        ct = ct->chain.cqe_next;
-    }
-    
-    if(ct == neobox.timer.cqh_first)
-    {
-        it.it_interval.tv_sec = 0;
-        it.it_interval.tv_usec = 0;
-        it.it_value.tv_sec = sec;
-        it.it_value.tv_usec = msec*1000;
-        if(setitimer(ITIMER_REAL, &it, 0) == -1)
-        {
-            neobox_fprintf(1, stderr, "Failed to set %s timer %i [%u.%u]: %s\n",
-                type == TIMER_SYSTEM ? "system" : "user",
-                id, sec, msec, strerror(errno));
-            free(nct);
-            sigprocmask(SIG_SETMASK, &oldset, 0);
-            return -1;
-        }
-        CIRCLEQ_INSERT_HEAD(&neobox.timer, nct, chain);
-    }
-    else
-    {
-        if(ct == (void*)&neobox.timer)
-            CIRCLEQ_INSERT_TAIL(&neobox.timer, nct, chain);
-        else
-            CIRCLEQ_INSERT_BEFORE(&neobox.timer, ct, nct, chain);
-    }
-    
-    sigprocmask(SIG_SETMASK, &oldset, 0);
-    
-    return 0;
+    return neobox.options & NEOBOX_OPTION_PROFILE ? iod_hist_now() : 0;
 }
 
-int neobox_handle_timer(unsigned char *id, unsigned char *type)
+void neobox_profile_hist(const char *name, const struct iod_hist *hist)
 {
-    struct neobox_chain_timer *ct = neobox.timer.cqh_first;
-    struct itimerval it;
-    struct timeval *tv = &it.it_value;
-    struct timespec tsp;
-    char buf[10];
-    int i, x;
-    
-    if(ct == (void*)&neobox.timer)
-        return 0;
-    
-    i = *id = ct->id;
-    *type = ct->type;
-    
-    CIRCLEQ_REMOVE(&neobox.timer, ct, chain);
-    free(ct);
-    
-    if(neobox.verbose && *type == TIMER_USER)
-    {
-        WRITE_STR(0, "[");
-        WRITE_STR(0, neobox.appname);
-        WRITE_STR(0, "][NEOBOX] timer ");
-        WRITE_INT_STR(0, i, x, buf, 10, " event\n");
-    }
-    
-    if((ct = neobox.timer.cqh_first) == (void*)&neobox.timer)
-        return 0;
-    
-    clock_gettime(CLOCK_REALTIME, &tsp);
-    
-    tv->tv_sec = tsp.tv_sec;
-    tv->tv_usec = tsp.tv_nsec/1000;
-    
-    it.it_interval.tv_sec = 0;
-    it.it_interval.tv_usec = 0;
-    
-    if(tv->tv_sec >= ct->tv.tv_sec && tv->tv_usec >= ct->tv.tv_usec)
-        return 1;
-    
-    tv->tv_sec = ct->tv.tv_sec - tv->tv_sec;
-    if(tv->tv_usec <= ct->tv.tv_usec)
-        tv->tv_usec = ct->tv.tv_usec - tv->tv_usec;
-    else
-    {
-        tv->tv_sec--;
-        tv->tv_usec = 1000000 - tv->tv_usec + ct->tv.tv_usec;
-    }
-    
-    if(setitimer(ITIMER_REAL, &it, 0) == -1)
-    {
-        if(neobox.verbose)
-        {
-            WRITE_STR(0, "[");
-            WRITE_STR(0, neobox.appname);
-            WRITE_STR(1, "][NEOBOX] Failed to set ");
-            WRITE_STR(1, ct->type == TIMER_SYSTEM ? "system timer " : "user timer ");
-            WRITE_INT_STR(1, ct->id, x, buf, 10, " [");
-            WRITE_INT_STR(1, tv->tv_sec, x, buf, 10, ".");
-            tv->tv_usec /= 1000;
-            WRITE_INT_STR(1, tv->tv_usec, x, buf, 10, "]: ");
-            WRITE_STR(1, strerror(errno));
-            WRITE_STR(1, "\n");
-        }
-        CIRCLEQ_REMOVE(&neobox.timer, ct, chain);
-        free(ct);
-        return -1;
-    }
+    // log prefix only, the line is printed like in iod
+    neobox_printf(0, "");
+    iod_hist_print(stdout, name, hist);
+}
+
+void neobox_profile_print()
+{
+    neobox_profile_hist("transport", &neobox.profile.transport);
+    neobox_profile_hist("parse", &neobox.profile.parse);
+    neobox_profile_hist("draw", &neobox.profile.draw);
+    neobox_profile_hist("handler", &neobox.profile.handler);
+    neobox_profile_hist("total", &neobox.profile.total);
+    neobox_printf(0, "iod events: %u received, %u dispatched\n",
+        neobox.iod.received, neobox.iod.dispatched);
+}
+
+// iod swipe direction to layout direction
+int neobox_gesture_dir(int dir)
+{
+    // screen y is inverted, landscape turns the screen
+    static const int portrait[] = { NEOBOX_GESTURE_DOWN, NEOBOX_GESTURE_UP,
+        NEOBOX_GESTURE_LEFT, NEOBOX_GESTURE_RIGHT };
+    static const int landscape[] = { NEOBOX_GESTURE_RIGHT, NEOBOX_GESTURE_LEFT,
+        NEOBOX_GESTURE_DOWN, NEOBOX_GESTURE_UP };
     
-    return 0;
+    if(neobox.format == NEOBOX_FORMAT_LANDSCAPE)
+        return landscape[dir & 3];
+    return portrait[dir & 3];
+}
+
+// only the active app competes with iod for the cpu
+void neobox_realtime(int active)
+{
+    if(!(neobox.options & NEOBOX_OPTION_REALTIME))
+        return;
+    if(iod_rt_priority(active ? neobox.realtime : 0) == -1)
+        neobox_perror(1, "Failed to set realtime priority");
 }
 
-struct neobox_event neobox_parse_iod_event(struct iod_event iod_event)
+struct neobox_event neobox_parse_iod_event(struct iod_tevent iod_event)
 {
     struct neobox_event event, event2;
     const struct neobox_map *map;
@@ -996,7 +1849,9 @@ struct neobox_event neobox_parse_iod_event(struct iod_event iod_event)
     int y, x, button_y, button_x, i, ev_y, ev_x, map_prev;
     int width, height, fb_height, fb_width, scr_height, scr_width;
     SIMV(char sim_tmp = 'x');
+    long long start;
     
+    neobox.iod.dispatched++;
     event.type = NEOBOX_EVENT_NOP;
     event.id = 0;
     event.value.i = 0;
@@ -1005,16 +1860,22 @@ struct neobox_event neobox_parse_iod_event(struct iod_event iod_event)
     {
     case IOD_EVENT_ACTIVATED:
         neobox_printf(1, "activate\n");
+        neobox_realtime(1);
         event.type = NEOBOX_EVENT_ACTIVATE;
         return event;
     case IOD_EVENT_DEACTIVATED:
         neobox_printf(1, "deactivate\n");
+        neobox_realtime(0);
         event.type = NEOBOX_EVENT_DEACTIVATE;
         return event;
     case IOD_EVENT_REMOVED:
         neobox_printf(1, "removed\n");
         event.type = NEOBOX_EVENT_REMOVE;
         return event;
+    case IOD_EVENT_PREACTIVATE:
+        neobox_printf(1, "preactivate\n");
+        event.type = NEOBOX_EVENT_PREACTIVATE;
+        return event;
     case IOD_EVENT_AUX:
         neobox_printf(1, "AUX %s\n",
             iod_event.value.status ? "pressed" : "released");
@@ -1030,8 +1891,46 @@ struct neobox_event neobox_parse_iod_event(struct iod_event iod_event)
         event.value.i = iod_event.value.status;
         return event;
     case IOD_EVENT_LOCK:
+        // replies carry no request id, only the last one answers the
+        // current request, earlier ones were superseded or timed out
+        if(!neobox.iod.lock_requests || --neobox.iod.lock_requests)
+            return event;
+        event.id = neobox.iod.lock;
+        event.value.i = iod_event.value.status & IOD_SUCCESS_MASK ?
+            NEOBOX_SET_SUCCESS : NEOBOX_SET_FAILURE;
+        neobox_printf(1, "%s %s\n", neobox.iod.lock ? "lock" : "unlock",
+            event.value.i ? "failure" : "success");
+        if(event.value.i)
+            neobox.iod.lock = 0;
+        // replies after a timeout only update the state
+        if(neobox.iod.lock_pending)
+        {
+            neobox.iod.lock_pending = 0;
+            neobox_remove_timer(TIMER_LOCK, TIMER_SYSTEM);
+            event.type = NEOBOX_EVENT_LOCK;
+        }
         return event;
     case IOD_EVENT_GRAB:
+        i = (iod_event.value.status & ~IOD_SUCCESS_MASK) == IOD_GRAB_AUX ?
+            NEOBOX_BUTTON_AUX : NEOBOX_BUTTON_POWER;
+        // like LOCK, counted per button
+        if(!neobox.iod.grab_requests[GRAB_INDEX(i)] || --neobox.iod.grab_requests[GRAB_INDEX(i)])
+            return event;
+        event.id = i;
+        event.value.i = iod_event.value.status & IOD_SUCCESS_MASK ?
+            NEOBOX_SET_SUCCESS : NEOBOX_SET_FAILURE;
+        neobox_printf(1, "%s %s\n", neobox.iod.grab & i ? "grab" : "ungrab",
+            event.value.i ? "failure" : "success");
+        if(event.value.i)
+            neobox.iod.grab &= ~i;
+        if(neobox.iod.grab_pending & i)
+        {
+            neobox.iod.grab_pending &= ~i;
+            neobox_remove_timer(TIMER_GRAB+GRAB_INDEX(i), TIMER_SYSTEM);
+            event.type = NEOBOX_EVENT_GRAB;
+        }
+        return event;
+    case IOD_EVENT_RING:
         return event;
     case IOD_EVENT_POWERSAVE:
         neobox_printf(1, "Powersave %s\n",
@@ -1039,6 +1938,24 @@ struct neobox_event neobox_parse_iod_event(struct iod_event iod_event)
         event.type = NEOBOX_EVENT_POWERSAVE;
         event.value.i = iod_event.value.status;
         return event;
+    case IOD_EVENT_GESTURE:
+        neobox_printf(1, "Gesture %i\n", IOD_GESTURE_TYPE(iod_event.value.status));
+        event.type = NEOBOX_EVENT_GESTURE;
+        event.id = IOD_GESTURE_TYPE(iod_event.value.status);
+        event.value.i = neobox_gesture_dir(IOD_GESTURE_DIR(iod_event.value.status))
+            | IOD_GESTURE_SPEED(iod_event.value.status) << 4;
+        return event;
+    case IOD_EVENT_MESSAGE:
+        // messages are parsed in the order they were received
+        neobox_iod_message_done();
+        if(neobox.iod.messages.cqh_first == (void*)&neobox.iod.messages)
+            return event;
+        neobox.iod.message = neobox.iod.messages.cqh_first;
+        CIRCLEQ_REMOVE(&neobox.iod.messages, neobox.iod.message, chain);
+        neobox_printf(1, "Message on %s\n", neobox.iod.message->message.topic);
+        event.type = NEOBOX_EVENT_MESSAGE;
+        event.value.i = iod_event.value.status;
+        return event;
     case IOD_EVENT_MOVED:
     case IOD_EVENT_RELEASED:
     case IOD_EVENT_PRESSED:
@@ -1093,6 +2010,9 @@ struct neobox_event neobox_parse_iod_event(struct iod_event iod_event)
     // partner of last button
     partner_last = save_last->partner;
     
+    // types draw the button state
+    start = neobox_profile_now();
+    
     switch(iod_event.event)
     {
     case IOD_EVENT_MOVED:
@@ -1159,7 +2079,7 @@ move:           TYPEFUNC(elem_last, move, event=, y, x, button_y,
             
             neobox.parser.pressed = 1;
             
-            neobox_add_timer(0, TIMER_SYSTEM, 0, DELAY);
+            neobox_add_timer(TIMER_PAUSE, TIMER_SYSTEM, DELAY, 0, 0);
         }
         break;
     }
@@ -1174,6 +2094,12 @@ move:           TYPEFUNC(elem_last, move, event=, y, x, button_y,
     // notify framebuffer for redraw
     SIMV(send(neobox.fb.sock, &sim_tmp, 1, 0));
     
+    if(start)
+    {
+        neobox.profile.drawn = neobox_profile_now()-start;
+        iod_hist_add(&neobox.profile.draw, neobox.profile.drawn);
+    }
+    
     return event;
 }
 
@@ -1197,6 +2123,8 @@ int neobox_handle_return(int ret, struct neobox_event event, neobox_handler *han
                 event.type = NEOBOX_EVENT_QUIT;
                 return neobox_handle_return(handler(event, state), event, 0, 0);
             }
+            if(event.value.i == SIGUSR1 && neobox.options & NEOBOX_OPTION_PROFILE)
+                neobox_profile_print();
             return NEOBOX_HANDLER_SUCCESS;
         case NEOBOX_EVENT_ACTIVATE:
             if(neobox.options & NEOBOX_OPTION_PRINT_MASK &&
@@ -1254,35 +2182,74 @@ int neobox_handle_return(int ret, struct neobox_event event, neobox_handler *han
             return NEOBOX_HANDLER_SUCCESS;
         }
     }
-    return ret;
-}
-
-int neobox_handle_event(neobox_handler *handler, void *state)
-{
-    struct iod_event iod_event;
-    struct neobox_event event;
+    return ret;
+}
+
+int neobox_handle_event(neobox_handler *handler, void *state)
+{
+    struct iod_tevent iod_event;
+    struct neobox_event event;
+    long long start, now;
+    int ret;
+    
+    if(neobox.iod.ring)
+    {
+        iod_ring_wake(neobox.iod.ring);
+        eventfd_read(neobox.iod.ring_fd, &(eventfd_t){0});
+    }
+    
+    if((ret = neobox_iod_poll(&iod_event)))
+    {
+        // nothing pending
+        if(ret == -1)
+            return NEOBOX_HANDLER_SUCCESS;
+        neobox_iod_reconnect(-1);
+        return NEOBOX_HANDLER_SUCCESS;
+    }
+    
+    neobox_iod_collapse(&iod_event);
+    
+    if(!(start = neobox_profile_now()))
+    {
+        event = neobox_parse_iod_event(iod_event);
+        
+        if(event.type != NEOBOX_EVENT_NOP)
+            return neobox_handle_return(handler(event, state), event, handler, state);
+        else
+            return NEOBOX_HANDLER_SUCCESS;
+    }
     
-    if(neobox_iod_recv(&iod_event))
-        return NEOBOX_HANDLER_SUCCESS;
+    iod_hist_add(&neobox.profile.transport, iod_hist_since(&iod_event.time, start));
     
+    neobox.profile.drawn = 0;
     event = neobox_parse_iod_event(iod_event);
+    now = neobox_profile_now();
+    iod_hist_add(&neobox.profile.parse, now-start-neobox.profile.drawn);
     
+    ret = NEOBOX_HANDLER_SUCCESS;
     if(event.type != NEOBOX_EVENT_NOP)
-        return neobox_handle_return(handler(event, state), event, handler, state);
-    else
-        return NEOBOX_HANDLER_SUCCESS;
+    {
+        start = now;
+        ret = handler(event, state);
+        now = neobox_profile_now();
+        iod_hist_add(&neobox.profile.handler, now-start);
+        ret = neobox_handle_return(ret, event, handler, state);
+    }
+    
+    // input to pixels, handler draws directly into the framebuffer
+    iod_hist_add(&neobox.profile.total, iod_hist_since(&iod_event.time, now));
+    
+    return ret;
 }
 
-int neobox_handle_queue(neobox_handler *handler, void *state, sigset_t *oldset)
+int neobox_handle_queue(neobox_handler *handler, void *state)
 {
     struct neobox_stash stash;
     struct neobox_event event;
     int ret;
     
-    while((stash = neobox_get_event(oldset)).type != STASH_NOP)
+    while(!neobox_queue_pop(&stash))
     {
-        if(oldset)
-            sigprocmask(SIG_SETMASK, oldset, 0);
         switch(stash.type)
         {
         case STASH_IOD:
@@ -1302,20 +2269,185 @@ int neobox_handle_queue(neobox_handler *handler, void *state, sigset_t *oldset)
     return NEOBOX_HANDLER_SUCCESS;
 }
 
+struct neobox_watch* neobox_watch_find(int fd)
+{
+    struct neobox_watch *watch;
+    
+    LIST_FOREACH(watch, &neobox.watches, chain)
+        if(watch->fd == fd)
+            return watch;
+    
+    return 0;
+}
+
+int neobox_watch(int fd, int events, int id, neobox_handler *handler, void *state)
+{
+    struct epoll_event ev;
+    struct neobox_watch *watch;
+    int op = EPOLL_CTL_MOD;
+    
+    if(!(watch = neobox_watch_find(fd)))
+    {
+        if(!(watch = malloc(sizeof(struct neobox_watch))))
+        {
+            neobox_perror(1, "Failed to allocate watch");
+            return NEOBOX_ERROR_POLL;
+        }
+        op = EPOLL_CTL_ADD;
+    }
+    
+    ev.events = (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    // closed fds leave epoll without being unwatched
+    if(epoll_ctl(neobox.iod.epfd, op, fd, &ev) == -1 &&
+        (op == EPOLL_CTL_ADD || errno != ENOENT ||
+        epoll_ctl(neobox.iod.epfd, EPOLL_CTL_ADD, fd, &ev) == -1))
+    {
+        neobox_perror(1, "Failed to poll watched fd");
+        if(op == EPOLL_CTL_ADD)
+            free(watch);
+        return NEOBOX_ERROR_POLL;
+    }
+    
+    if(op == EPOLL_CTL_ADD)
+        LIST_INSERT_HEAD(&neobox.watches, watch, chain);
+    
+    watch->fd = fd;
+    watch->id = id;
+    watch->handler = handler;
+    watch->state = state;
+    
+    return 0;
+}
+
+int neobox_watch_fd(int fd, int events, neobox_handler *handler, void *state)
+{
+    return neobox_watch(fd, events, 0, handler, state);
+}
+
+void neobox_unwatch_fd(int fd)
+{
+    struct neobox_watch *watch;
+    
+    if(!(watch = neobox_watch_find(fd)))
+        return;
+    
+    // fails if fd was already closed
+    epoll_ctl(neobox.iod.epfd, EPOLL_CTL_DEL, fd, 0);
+    LIST_REMOVE(watch, chain);
+    free(watch);
+}
+
+int neobox_handle_watch(const struct epoll_event *ev, neobox_handler *handler, void *state)
+{
+    struct neobox_watch *watch;
+    struct neobox_event event;
+    
+    // unwatched by an earlier handler of the same wait
+    if(!(watch = neobox_watch_find(ev->data.fd)))
+        return NEOBOX_HANDLER_SUCCESS;
+    
+    event.id = watch->id;
+    event.value.i = watch->fd;
+    if(watch->handler)
+    {
+        handler = watch->handler;
+        state = watch->state;
+    }
+    
+    // data left before a hangup is read first
+    if(ev->events & EPOLLIN)
+        event.type = NEOBOX_EVENT_POLLIN;
+    else if(ev->events & (EPOLLHUP|EPOLLERR))
+    {
+        // hangups are reported until the fd is removed
+        event.type = NEOBOX_EVENT_POLLHUPERR;
+        neobox_unwatch_fd(watch->fd);
+    }
+    else
+        event.type = NEOBOX_EVENT_POLLOUT;
+    
+    return neobox_handle_return(handler(event, state), event, handler, state);
+}
+
+int neobox_handle_epoll(neobox_handler *handler, void *state, int timeout)
+{
+    struct epoll_event evs[EPOLL_EVENTS];
+    int ret, i, n, iod;
+    
+    if((n = epoll_wait(neobox.iod.epfd, evs, EPOLL_EVENTS, timeout)) == -1)
+    {
+        if(errno == EINTR)
+            return NEOBOX_HANDLER_SUCCESS;
+        
+        neobox_perror(1, "Failed to poll iod");
+        return NEOBOX_ERROR_POLL;
+    }
+    
+    for(i=0, iod=0; i<n; i++)
+    {
+        if(evs[i].data.fd == neobox.queue_fd)
+            eventfd_read(neobox.queue_fd, &(eventfd_t){0});
+        else if(evs[i].data.fd == neobox.signal_fd)
+            neobox_read_signals();
+        else if(evs[i].data.fd == neobox.timer.fd)
+            neobox_read_timers();
+        else if(evs[i].data.fd == neobox.iod.sock ||
+            (neobox.iod.ring && evs[i].data.fd == neobox.iod.ring_fd))
+            iod = 1;
+        else if((ret = neobox_handle_watch(&evs[i], handler, state)) != NEOBOX_HANDLER_SUCCESS)
+            return ret;
+    }
+    
+    if(!iod)
+        return NEOBOX_HANDLER_SUCCESS;
+    
+    return neobox_handle_event(handler, state);
+}
+
+int neobox_dispatch(neobox_handler *handler, void *state, int timeout)
+{
+    int ret;
+    
+    // queued by blocking calls since the last dispatch
+    if((ret = neobox_handle_queue(handler, state)) != NEOBOX_HANDLER_SUCCESS)
+        return ret;
+    
+    // ring events do not need to wait for the doorbell
+    if(neobox_iod_pending())
+        timeout = 0;
+    
+    if((ret = neobox_handle_epoll(handler, state, timeout)) != NEOBOX_HANDLER_SUCCESS)
+        return ret;
+    
+    // buffered and ring events leave epfd quiet, drain them before
+    // the caller waits on it again
+    while(neobox_iod_pending())
+        if((ret = neobox_handle_event(handler, state)) != NEOBOX_HANDLER_SUCCESS)
+            return ret;
+    
+    // signals and timers read above
+    return neobox_handle_queue(handler, state);
+}
+
+int neobox_fd()
+{
+    return neobox.iod.epfd;
+}
+
 int neobox_run_pfds(neobox_handler *handler, void *state, struct pollfd *pfds, int count)
 {
     struct neobox_event event;
     int ret, i;
-    sigset_t set;
     
-    pfds[0].fd = neobox.iod.sock;
+    pfds[0].fd = neobox.iod.epfd;
     pfds[0].events = POLLIN;
     
     neobox_printf(1, "run\n");
     
     while(1)
     {
-        switch((ret = neobox_handle_queue(handler, state, &set)))
+        switch((ret = neobox_handle_queue(handler, state)))
         {
         case NEOBOX_HANDLER_SUCCESS:
             break;
@@ -1325,64 +2457,67 @@ int neobox_run_pfds(neobox_handler *handler, void *state, struct pollfd *pfds, i
             return ret & ~NEOBOX_HANDLER_ERROR;
         }
         
-        if(ppoll(pfds, count, 0, &set) == -1)
+        // ring events do not need to wait for the doorbell
+        if(neobox_iod_pending())
         {
-            sigprocmask(SIG_SETMASK, &set, 0);
-            
-            if(errno == EINTR)
-                continue;
-            
-            neobox_perror(1, "Failed to poll");
-            return NEOBOX_ERROR_POLL;
+            ret = neobox_handle_event(handler, state);
+            goto handle;
         }
         
-        sigprocmask(SIG_SETMASK, &set, 0);
-        
-        if(pfds[0].revents & POLLHUP || pfds[0].revents & POLLERR)
-        {
-            neobox_printf(1, "Failed to poll iod socket\n");
-            neobox_iod_reconnect(-1);
-        }
-        else if(pfds[0].revents & POLLIN)
+        // signals and timers are polled in epfd
+        if(count > 1)
         {
-            ret = neobox_handle_event(handler, state);
-handle:     switch(ret)
+            if(poll(pfds, count, -1) == -1)
             {
-            case NEOBOX_HANDLER_SUCCESS:
-                break;
-            case NEOBOX_HANDLER_QUIT:
-                return 0;
-            default:
-                return ret & ~NEOBOX_HANDLER_ERROR;
+                if(errno == EINTR)
+                    continue;
+                
+                neobox_perror(1, "Failed to poll");
+                return NEOBOX_ERROR_POLL;
             }
-        }
-        else
-        {
-            event.type = NEOBOX_EVENT_NOP;
             
-            for(i=1; i<count; i++)
+            if(!(pfds[0].revents & POLLIN))
             {
-                event.id = i;
-                event.value.i = pfds[i].fd;
+                event.type = NEOBOX_EVENT_NOP;
                 
-                if(pfds[i].revents & POLLHUP || pfds[i].revents & POLLERR)
+                for(i=1; i<count; i++)
                 {
-                    pfds[i].events = 0;
-                    event.type = NEOBOX_EVENT_POLLHUPERR;
-                }
-                else if(pfds[i].revents & POLLIN)
-                    event.type = NEOBOX_EVENT_POLLIN;
-                else if(pfds[i].revents & POLLOUT)
-                    event.type = NEOBOX_EVENT_POLLOUT;
-                
-                if(event.type != NEOBOX_EVENT_NOP)
-                {
-                    ret = neobox_handle_return(handler(event, state),
-                        event, handler, state);
-                    goto handle;
+                    event.id = i;
+                    event.value.i = pfds[i].fd;
+                    
+                    if(pfds[i].revents & POLLHUP || pfds[i].revents & POLLERR)
+                    {
+                        pfds[i].events = 0;
+                        event.type = NEOBOX_EVENT_POLLHUPERR;
+                    }
+                    else if(pfds[i].revents & POLLIN)
+                        event.type = NEOBOX_EVENT_POLLIN;
+                    else if(pfds[i].revents & POLLOUT)
+                        event.type = NEOBOX_EVENT_POLLOUT;
+                    
+                    if(event.type != NEOBOX_EVENT_NOP)
+                    {
+                        ret = neobox_handle_return(handler(event, state),
+                            event, handler, state);
+                        goto handle;
+                    }
                 }
+                continue;
             }
         }
+        
+        // epfd is known to be ready if polled with pfds
+        if((ret = neobox_handle_epoll(handler, state, count > 1 ? 0 : -1)) < 0)
+            return ret;
+handle: switch(ret)
+        {
+        case NEOBOX_HANDLER_SUCCESS:
+            break;
+        case NEOBOX_HANDLER_QUIT:
+            return 0;
+        default:
+            return ret & ~NEOBOX_HANDLER_ERROR;
+        }
     }
     
     return 0;
@@ -1390,8 +2525,17 @@ handle:     switch(ret)
 
 int neobox_run(neobox_handler *handler, void *state)
 {
-    struct pollfd pfds[1];
-    return neobox_run_pfds(handler, state, pfds, 1);
+    int ret;
+    
+    neobox_printf(1, "run\n");
+    
+    while((ret = neobox_dispatch(handler, state, -1)) == NEOBOX_HANDLER_SUCCESS);
+    
+    if(ret < 0)
+        return ret;
+    if(ret == NEOBOX_HANDLER_QUIT)
+        return 0;
+    return ret & ~NEOBOX_HANDLER_ERROR;
 }
 
 void neobox_switch(pid_t pid)
@@ -1417,43 +2561,201 @@ void neobox_powersave(int powersave)
         neobox_iod_reconnect(-1);
 }
 
-int neobox_lock(int lock)
+void neobox_subscribe(int events)
+{
+    // touch, lifecycle and lock/grab replies are used by neobox itself
+    int classes = IOD_CLASS_DEFAULT &
+        ~(IOD_CLASS_AUX|IOD_CLASS_POWER|IOD_CLASS_POWERSAVE);
+    
+    if(events & NEOBOX_SUBSCRIBE_AUX)
+        classes |= IOD_CLASS_AUX;
+    if(events & NEOBOX_SUBSCRIBE_POWER)
+        classes |= IOD_CLASS_POWER;
+    if(events & NEOBOX_SUBSCRIBE_POWERSAVE)
+        classes |= IOD_CLASS_POWERSAVE;
+    if(events & NEOBOX_SUBSCRIBE_GESTURE)
+        classes |= IOD_CLASS_GESTURE;
+    
+    while(neobox_iod_cmd(IOD_CMD_SUBSCRIBE, 0, classes))
+        neobox_iod_reconnect(-1);
+    neobox.iod.classes = classes;
+}
+
+int neobox_topic(const char *topic, int subscribe)
+{
+    int i, slot = -1;
+    
+    // v1 commands have no room for the topic
+    if(neobox.iod.version < 2 || !topic[0] || strlen(topic) > NEOBOX_TOPIC_SIZE)
+        return NEOBOX_SET_FAILURE;
+    
+    for(i=0; i<TOPICS && strcmp(neobox.iod.topics[i], topic); i++)
+        if(slot == -1 && !neobox.iod.topics[i][0])
+            slot = i;
+    
+    // remembered for reconnects
+    if(subscribe && i == TOPICS)
+    {
+        if(slot == -1)
+            return NEOBOX_SET_FAILURE;
+        strcpy(neobox.iod.topics[slot], topic);
+    }
+    else if(!subscribe && i < TOPICS)
+        neobox.iod.topics[i][0] = 0;
+    
+    while(neobox_iod_topic(topic, subscribe))
+        neobox_iod_reconnect(-1);
+    
+    return NEOBOX_SET_SUCCESS;
+}
+
+int neobox_publish(const char *topic, const void *data, int size)
+{
+    struct iod_cmd_message iod;
+    char name[32];
+    void *ptr;
+    int fd = -1;
+    
+    if(neobox.iod.version < 2 || !topic[0] || strlen(topic) > NEOBOX_TOPIC_SIZE || size < 0)
+        return NEOBOX_SET_FAILURE;
+    
+    memset(&iod, 0, sizeof(iod));
+    iod.cmd.cmd = IOD_CMD_PUBLISH;
+    strcpy(iod.message.topic, topic);
+    iod.message.size = size;
+    
+    if(size <= IOD_MESSAGE_SIZE)
+        memcpy(iod.message.data, data, size);
+    else
+    {
+        // larger payloads are passed as shared memory
+        sprintf(name, "/neobox.%i.%u", getpid(), neobox.iod.published++);
+        if((fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600)) == -1)
+        {
+            neobox_perror(1, "Failed to open message shared memory");
+            return NEOBOX_SET_FAILURE;
+        }
+        shm_unlink(name);
+        
+        if(ftruncate(fd, size) == -1 || (ptr = mmap(0, size,
+            PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        {
+            neobox_perror(1, "Failed to map message shared memory");
+            close(fd);
+            return NEOBOX_SET_FAILURE;
+        }
+        memcpy(ptr, data, size);
+        munmap(ptr, size);
+        iod.message.flags = IOD_MESSAGE_SHM;
+    }
+    
+    while(neobox_iod_send(&iod, sizeof(iod), fd))
+        neobox_iod_reconnect(-1);
+    
+    if(fd != -1)
+        close(fd);
+    
+    return NEOBOX_SET_SUCCESS;
+}
+
+const void* neobox_message(const char **topic, int *size)
+{
+    struct neobox_chain_message *cm = neobox.iod.message;
+    void *ptr;
+    
+    if(!cm)
+        return 0;
+    
+    if(topic)
+        *topic = cm->message.topic;
+    if(size)
+        *size = cm->message.size;
+    
+    if(cm->fd == -1)
+        return cm->message.data;
+    
+    // mapped until the next message
+    if(!neobox.iod.message_map)
+    {
+        if((ptr = mmap(0, cm->message.size, PROT_READ, MAP_SHARED, cm->fd, 0)) == MAP_FAILED)
+        {
+            neobox_perror(1, "Failed to map message shared memory");
+            return 0;
+        }
+        neobox.iod.message_map = ptr;
+    }
+    
+    return neobox.iod.message_map;
+}
+
+int neobox_region(int y, int x, int height, int width, int z)
 {
-    struct iod_event event;
+    // v1 commands have no room for the region
+    if(neobox.iod.version < 2)
+        return NEOBOX_SET_FAILURE;
+    
+    neobox.iod.region.y = y;
+    neobox.iod.region.x = x;
+    neobox.iod.region.height = height > 0 ? height : 0;
+    neobox.iod.region.width = width > 0 ? width : 0;
+    neobox.iod.z = z;
     
+    while(neobox_iod_region())
+        neobox_iod_reconnect(-1);
+    
+    return NEOBOX_SET_SUCCESS;
+}
+
+int neobox_lock_async(int lock, unsigned int timeout)
+{
     while(neobox_iod_cmd(IOD_CMD_LOCK, 0, lock))
         neobox_iod_reconnect(-1);
     
     neobox.iod.lock = lock;
+    neobox.iod.lock_pending = 1;
+    neobox.iod.lock_requests++;
+    
+    if(timeout)
+        return neobox_add_timer(TIMER_LOCK, TIMER_SYSTEM, timeout, 0, 0);
+    
+    neobox_remove_timer(TIMER_LOCK, TIMER_SYSTEM);
+    
+    return 0;
+}
+
+int neobox_lock(int lock)
+{
+    struct iod_tevent iod_event;
+    struct neobox_event event;
     
+    neobox_lock_async(lock, 0);
+    
+    // the reply completes here instead of in the handler
     while(1)
     {
-        while(neobox_iod_recv(&event))
+        while(neobox_iod_recv(&iod_event))
             neobox_iod_reconnect(-1);
         
-        if(event.event != IOD_EVENT_LOCK)
+        // replies are counted in arrival order, so they are not stashed
+        if(iod_event.event == IOD_EVENT_GRAB)
         {
-            neobox_queue_event(STASH_IOD, &event);
+            event = neobox_parse_iod_event(iod_event);
+            neobox_queue_event(STASH_NEOBOX, &event);
             continue;
         }
-        
-        if(event.value.status & IOD_SUCCESS_MASK)
-        {
-            neobox_printf(1, "%s success\n", lock ? "lock" : "unlock");
-            return NEOBOX_SET_SUCCESS;
-        }
-        else
+        if(iod_event.event != IOD_EVENT_LOCK)
         {
-            neobox_printf(1, "%s failure\n", lock ? "lock" : "unlock");
-            neobox.iod.lock = 0;
-            return NEOBOX_SET_FAILURE;
+            neobox_queue_event(STASH_IOD, &iod_event);
+            continue;
         }
+        
+        if((event = neobox_parse_iod_event(iod_event)).type == NEOBOX_EVENT_LOCK)
+            return event.value.i;
     }
 }
 
-int neobox_grab(int button, int grab)
+int neobox_grab_async(int button, int grab, unsigned int timeout)
 {
-    struct iod_event event;
     int value = 0;
     
     if(grab)
@@ -1477,86 +2779,108 @@ int neobox_grab(int button, int grab)
         neobox.iod.grab |= button;
     else
         neobox.iod.grab &= ~button;
-        
+    neobox.iod.grab_pending |= button;
+    neobox.iod.grab_requests[GRAB_INDEX(button)]++;
+    
+    if(timeout)
+        return neobox_add_timer(TIMER_GRAB+GRAB_INDEX(button), TIMER_SYSTEM, timeout, 0, 0);
+    
+    neobox_remove_timer(TIMER_GRAB+GRAB_INDEX(button), TIMER_SYSTEM);
+    
+    return 0;
+}
+
+int neobox_grab(int button, int grab)
+{
+    struct iod_tevent iod_event;
+    struct neobox_event event;
+    int ret;
+    
+    if((ret = neobox_grab_async(button, grab, 0)))
+        return ret;
+    
+    // the reply completes here instead of in the handler
     while(1)
     {
-        while(neobox_iod_recv(&event))
+        while(neobox_iod_recv(&iod_event))
             neobox_iod_reconnect(-1);
         
-        if(event.event != IOD_EVENT_GRAB ||
-            (event.value.status & ~IOD_SUCCESS_MASK) !=
-            (value & ~IOD_GRAB_MASK))
+        if(iod_event.event != IOD_EVENT_GRAB && iod_event.event != IOD_EVENT_LOCK)
         {
-            neobox_queue_event(STASH_IOD, &event);
+            neobox_queue_event(STASH_IOD, &iod_event);
             continue;
         }
         
-        if(event.value.status & IOD_SUCCESS_MASK)
-        {
-            neobox_printf(1, "%s success\n", grab ? "grab" : "ungrab");
-            return NEOBOX_SET_SUCCESS;
-        }
-        else
-        {
-            neobox_printf(1, "%s failure\n", grab ? "grab" : "ungrab");
-            neobox.iod.grab &= ~button;
-            return NEOBOX_SET_FAILURE;
-        }
+        // replies are counted in arrival order, so they are not stashed
+        event = neobox_parse_iod_event(iod_event);
+        if(event.type == NEOBOX_EVENT_GRAB && event.id == button)
+            return event.value.i;
+        neobox_queue_event(STASH_NEOBOX, &event);
     }
 }
 
 int neobox_timer(unsigned char id, unsigned int sec, unsigned int msec)
 {
-    return neobox_add_timer(id, TIMER_USER, sec, msec);
+    return neobox_add_timer(id, TIMER_USER, sec*1000+msec, 0,
+        neobox.timer.slacks[id]);
 }
 
-void neobox_timer_remove(unsigned char id)
+int neobox_timer_repeat(unsigned char id, unsigned int sec, unsigned int msec)
 {
-    struct neobox_chain_timer *ct;
-    sigset_t sig, oldset;
+    if(!sec && !msec)
+        return -1;
     
-    sigfillset(&sig);
-    sigprocmask(SIG_BLOCK, &sig, &oldset);
+    return neobox_add_timer(id, TIMER_USER, sec*1000+msec, sec*1000+msec,
+        neobox.timer.slacks[id]);
+}
+
+void neobox_timer_slack(unsigned char id, unsigned int msec)
+{
+    struct neobox_timer_entry *timer;
+    int i = neobox.timer.pos[TIMER_USER][id];
     
-    ct = neobox.timer.cqh_first;
+    neobox.timer.slacks[id] = msec;
     
-    while(ct != (void*)&neobox.timer &&
-        (ct->type != TIMER_USER || ct->id != id))
-    {
-        ct = ct->chain.cqe_next;
-    }
+    if(i == -1)
+        return;
     
-    if(ct != (void*)&neobox.timer)
-    {
+    // applies to the pending expiry too
+    timer = &neobox.timer.heap[i];
+    timer->deadline = timer->expire + msec*1000LL;
+    if(msec*1000LL > neobox.timer.slack)
+        neobox.timer.slack = msec*1000LL;
+    neobox_timer_sift(i);
+    neobox_timer_arm();
+}
+
+void neobox_timer_remove(unsigned char id)
+{
+    if(neobox.timer.pos[TIMER_USER][id] != -1)
         neobox_printf(1, "timer %i removed\n", id);
-        CIRCLEQ_REMOVE(&neobox.timer, ct, chain);
-        free(ct);
-    }
     
-    sigprocmask(SIG_SETMASK, &oldset, 0);
+    neobox_remove_timer(id, TIMER_USER);
 }
 
 int neobox_sleep(unsigned int sec, unsigned int msec)
 {
-    sigset_t set, oldset;
+    struct timespec ts;
     int ret;
     
-    neobox.sleep = 1;
-    
-    if((ret = neobox_add_timer(1, TIMER_SYSTEM, sec, msec)))
-        return ret;
-    
     neobox_printf(1, "sleep %u.%u\n", sec, msec);
     
-    sigfillset(&set);
-    sigprocmask(SIG_BLOCK, &set, &oldset);
+    ts.tv_sec = sec + msec/1000;
+    ts.tv_nsec = msec%1000*1000000;
     
-    while(neobox.sleep)
-        sigsuspend(&oldset);
+    while((ret = clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts)) == EINTR);
     
-    sigprocmask(SIG_SETMASK, &oldset, 0);
+    return ret;
+}
+
+int neobox_sleep_async(unsigned int sec, unsigned int msec)
+{
+    neobox_printf(1, "sleep async %u.%u\n", sec, msec);
     
-    return 0;
+    return neobox_add_timer(TIMER_WAKE, TIMER_SYSTEM, sec*1000+msec, 0, 0);
 }
 
 void neobox_map_set(int map)
@@ -40,6 +40,7 @@
 #define NEOBOX_ERROR_POLL        -9
 #define NEOBOX_ERROR_REGISTER    -10
 #define NEOBOX_ERROR_CONFIG      -11
+#define NEOBOX_ERROR_TIMER       -12
 
 #define NEOBOX_FORMAT_LANDSCAPE  0
 #define NEOBOX_FORMAT_PORTRAIT   1
@@ -49,6 +50,9 @@
 #define NEOBOX_OPTION_FORCE_PRINT   2 // everything visible
 #define NEOBOX_OPTION_PRINT_MASK    3
 #define NEOBOX_OPTION_ADMINMAP      4 // enable admin goto in meta map
+#define NEOBOX_OPTION_RING          8 // request shared event ring from iod
+#define NEOBOX_OPTION_PROFILE      16 // latency histograms, dumped on SIGUSR1
+#define NEOBOX_OPTION_REALTIME     32 // SCHED_FIFO while active, locked memory
 
 #define NEOBOX_MAP_DEFAULT       -1
 #define NEOBOX_CONFIG_DEFAULT    0
@@ -62,8 +66,31 @@
 #define NEOBOX_BUTTON_AUX            1
 #define NEOBOX_BUTTON_POWER          2
 
+#define NEOBOX_SUBSCRIBE_AUX         1 // aux button events
+#define NEOBOX_SUBSCRIBE_POWER       2 // power button events
+#define NEOBOX_SUBSCRIBE_POWERSAVE   4 // powersave broadcasts
+#define NEOBOX_SUBSCRIBE_GESTURE     8 // taps, long presses and swipes
+#define NEOBOX_SUBSCRIBE_ALL         15
+
+#define NEOBOX_GESTURE_TAP           0
+#define NEOBOX_GESTURE_DOUBLE        1 // second tap, after its TAP
+#define NEOBOX_GESTURE_LONG          2
+#define NEOBOX_GESTURE_SWIPE         3
+#define NEOBOX_GESTURE_UP            0 // swipe directions in layout
+#define NEOBOX_GESTURE_DOWN          1
+#define NEOBOX_GESTURE_LEFT          2
+#define NEOBOX_GESTURE_RIGHT         3
+
+// GESTURE event: id is the gesture, value.i direction|speed
+#define NEOBOX_GESTURE_DIRECTION(i)  ((i) & 0xf)
+#define NEOBOX_GESTURE_SPEED(i)      ((i) >> 4) // screen units per second
+
+// MESSAGE event: value.i is the publisher pid, data by neobox_message
+#define NEOBOX_TOPIC_SIZE            15 // max topic name length
+
 #define NEOBOX_SET_SUCCESS           0
 #define NEOBOX_SET_FAILURE           1
+#define NEOBOX_SET_TIMEOUT           2
 
 #define NEOBOX_EVENT_NOP            0
 #define NEOBOX_EVENT_CHAR           1
@@ -83,6 +110,10 @@
 #define NEOBOX_EVENT_GRAB           15
 #define NEOBOX_EVENT_POWERSAVE      16
 #define NEOBOX_EVENT_TEXT           17
+#define NEOBOX_EVENT_GESTURE        18
+#define NEOBOX_EVENT_PREACTIVATE    19
+#define NEOBOX_EVENT_MESSAGE        20
+#define NEOBOX_EVENT_WAKE           21
 
 #define NEOBOX_HANDLER_SUCCESS       0
 #define NEOBOX_HANDLER_QUIT          1
@@ -97,6 +128,8 @@ struct neobox_options
     int options;
     int verbose;
     int map;
+    int cpu;
+    int realtime;   // iod -R priority, the active app runs IOD_RT_BELOW under it
 };
 
 struct neobox_event
@@ -118,13 +151,27 @@ typedef int neobox_handler(struct neobox_event event, void *state);
 int neobox_run(neobox_handler *handler, void *state);
 int neobox_run_pfds(neobox_handler *handler, void *state, struct pollfd *pfds, int count);
 
+// epoll fd of iod, signals, timers and watched fds for an own event loop
+int neobox_fd();
+// handles everything ready, waits up to timeout ms for it, -1 forever
+int neobox_dispatch(neobox_handler *handler, void *state, int timeout);
+// POLLIN/POLLOUT of fd go to handler, 0 for the dispatch handler
+int neobox_watch_fd(int fd, int events, neobox_handler *handler, void *state);
+void neobox_unwatch_fd(int fd);
+
 int neobox_handle_event(neobox_handler *handler, void *state);
-int neobox_handle_queue(neobox_handler *handler, void *state, sigset_t *oldset);
+int neobox_handle_queue(neobox_handler *handler, void *state);
 
 int neobox_catch_signal(int signal, int flags);
 
+// blocks the event loop, neobox_sleep_async sends WAKE instead
 int neobox_sleep(unsigned int sec, unsigned int msec);
+int neobox_sleep_async(unsigned int sec, unsigned int msec);
+// setting an active timer id again resets it
 int neobox_timer(unsigned char id, unsigned int sec, unsigned int msec);
+int neobox_timer_repeat(unsigned char id, unsigned int sec, unsigned int msec);
+// timer id may be delayed by msec to share a wakeup with other timers
+void neobox_timer_slack(unsigned char id, unsigned int msec);
 void neobox_timer_remove(unsigned char id);
 
 void neobox_init_screen();
@@ -132,9 +179,22 @@ void neobox_init_screen();
 void neobox_switch(pid_t pid);
 void neobox_hide(pid_t pid, int priority, int hide);
 void neobox_powersave(int powersave);
+void neobox_subscribe(int events);
+// claim touches in region of iod screen cords, empty releases
+int neobox_region(int y, int x, int height, int width, int z);
+
+int neobox_topic(const char *topic, int subscribe);
+int neobox_publish(const char *topic, const void *data, int size);
+// data of the MESSAGE event being handled, 0 if none
+const void* neobox_message(const char **topic, int *size);
 
 int neobox_lock(int lock);
+// LOCK event with NEOBOX_SET_* follows, timeout in ms, 0 waits forever
+int neobox_lock_async(int lock, unsigned int timeout);
+void neobox_profile_print();
 int neobox_grab(int button, int grab);
+// GRAB event with id button and NEOBOX_SET_* follows
+int neobox_grab_async(int button, int grab, unsigned int timeout);
 
 void neobox_map_set(int map);
 void neobox_map_reset();
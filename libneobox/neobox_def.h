@@ -25,9 +25,11 @@
 
 #include <linux/fb.h>
 #include <sys/queue.h>
+#include <signal.h>
 
 #include <alg/vector.h>
 #include <iod.h>
+#include <iod_hist.h>
 
 #include "neobox.h"
 
@@ -48,11 +50,26 @@
 #define SCREENMAX   830     // screen size in pixel
 #define DENSITY     1       // button draw density in pixel
 #define INCREASE    33      // button size increase in percent
-#define DELAY       100     // debouncer pause delay in us
+#define DELAY       100     // debouncer pause delay in ms
+#define IOD_BUFFER  1024    // bytes of received iod events
+#define TOPICS      8       // iod topics resubscribed on reconnect
+#define MESSAGE_FDS 4       // shared memory fds received before their message
+#define QUEUE_SIZE  256     // queued events, power of 2
+#define EPOLL_EVENTS 16     // internal and watched fds per wait
+
+#define TIMER_SYSTEMS 5     // system timer ids
+#define TIMERS      (256+TIMER_SYSTEMS) // user timers and system timers
 
 #define TIMER_SYSTEM 0
 #define TIMER_USER   1
 
+#define TIMER_PAUSE  0      // system timer, debouncer
+#define TIMER_WAKE   1      // system timer, neobox_sleep_async
+#define TIMER_LOCK   2      // system timer, lock request timeout
+#define TIMER_GRAB   (TIMER_LOCK+1) // system timer, grab request timeout +GRAB_INDEX
+
+#define GRAB_INDEX(button) ((button)-1) // NEOBOX_BUTTON_AUX/POWER to 0, 1
+
 #define STASH_NOP    0
 #define STASH_IOD    1
 #define STASH_NEOBOX 2
@@ -64,25 +81,67 @@ struct neobox_stash
     char type;
     union
     {
-        struct iod_event iod;
+        struct iod_tevent iod;
         struct neobox_event neobox;
     } event;
 };
 
-struct neobox_chain_queue
+struct neobox_queue_slot
 {
-    CIRCLEQ_ENTRY(neobox_chain_queue) chain;
+    unsigned int seq;   // slot position, +1 if written
     struct neobox_stash stash;
 };
-CIRCLEQ_HEAD(neobox_queue, neobox_chain_queue);
 
-struct neobox_chain_timer
+// Preallocated event queue, multiple producers including signal
+// handlers, the main loop is the only consumer. Producers claim a slot
+// by moving tail and publish it with seq, no allocation or signal mask.
+struct neobox_queue
+{
+    unsigned int head;  // next read
+    unsigned int tail;  // next write
+    unsigned int dropped; // events lost on full queue
+    struct neobox_queue_slot slots[QUEUE_SIZE];
+};
+
+struct neobox_chain_message
+{
+    CIRCLEQ_ENTRY(neobox_chain_message) chain;
+    struct iod_message message;
+    int fd;     // shared memory, -1 if inline
+};
+CIRCLEQ_HEAD(neobox_messages, neobox_chain_message);
+
+struct neobox_watch
 {
-    CIRCLEQ_ENTRY(neobox_chain_timer) chain;
-    struct timeval tv;
+    LIST_ENTRY(neobox_watch) chain;
+    int fd;
+    int id;         // event id, pfds index for neobox_run_pfds
+    neobox_handler *handler; // 0 for the dispatch handler
+    void *state;
+};
+LIST_HEAD(neobox_watches, neobox_watch);
+
+struct neobox_timer_entry
+{
+    long long expire;       // us CLOCK_MONOTONIC
+    long long deadline;     // expire plus slack
+    unsigned int period;    // us, 0 if one-shot
     unsigned char id, type;
 };
-CIRCLEQ_HEAD(neobox_timer, neobox_chain_timer);
+
+// Min-heap of timers ordered by deadline, the timerfd is armed for the
+// first one. All timers expired by then fire with it, so timers within
+// their slack of each other share one wakeup.
+struct neobox_timer
+{
+    int fd;                 // timerfd
+    int count;              // timers in heap
+    long long armed;        // deadline the timerfd is armed for, 0 if none
+    long long slack;        // largest slack in heap
+    short pos[2][256];      // heap index by type and id, -1 if not set
+    unsigned short slacks[256]; // user timer slack in ms
+    struct neobox_timer_entry heap[TIMERS];
+};
 
 struct neobox_point
 {
@@ -119,10 +178,36 @@ struct neobox_iod
 {
     const char *usock;
     int sock;
+    int version;    // protocol version
+    int hello;      // waiting for HELLO ack
+    char in[IOD_BUFFER]; // received events
+    int in_size, in_pos; // bytes received, bytes handled
+    int in_left, in_rsize; // records left in v2 frame, record size
+    int ring_shm, ring_efd; // ring fds received before the ring event
+    int epfd;       // epoll on sock and ring doorbell
+    struct iod_ring *ring; // shared event ring
+    int ring_fd;    // ring doorbell
     int lock;       // app has screen locked
     int hide;       // app is hidden
     int priority;   // apps hidden priority
     int grab;       // app grabbs buttons
+    int lock_pending; // waiting for LOCK reply
+    int grab_pending; // buttons waiting for GRAB reply
+    int lock_requests; // LOCK commands without reply
+    int grab_requests[2]; // GRAB commands without reply by GRAB_INDEX
+    int classes;    // subscribed iod event classes
+    struct iod_region region; // claimed touch region, empty if none
+    int z;          // z order of the region
+    char topics[TOPICS][IOD_TOPIC_SIZE]; // subscribed topics, empty if unused
+    struct neobox_messages messages; // received messages in event order
+    struct neobox_chain_message *message; // message being handled
+    void *message_map; // shared memory of message, 0 if not mapped
+    int message_fds[MESSAGE_FDS], message_nfds; // received message fds
+    unsigned int published; // shared memory messages, names the next
+    struct iod_tevent next; // read ahead while collapsing MOVED
+    int ahead;      // next is pending
+    unsigned int received; // events from socket and ring
+    unsigned int dispatched; // events passed to the parser
 };
 
 struct neobox_partner
@@ -144,14 +229,24 @@ struct neobox_config
     void *rj;
 };
 
+struct neobox_profile
+{
+    long long drawn;        // us drawing in current parse
+    struct iod_hist transport; // input event to libneobox
+    struct iod_hist parse;  // parser without drawing
+    struct iod_hist draw;   // button drawing by parser
+    struct iod_hist handler; // app handler
+    struct iod_hist total;  // input event to handler done
+};
+
 struct neobox_global
 {
     int format;         // portrait or landscape
     int pause;          // pause for debouncer
     int verbose;        // verbose messages
     int options;        // options from neobox init
+    int realtime;       // SCHED_FIFO priority while active
     char *flagstat;     // last partner flag per map
-    int sleep;          // sleep status
     char *appname;      // basename(argv[0])
     
     neobox_filter *filter_fun;  // filter events
@@ -163,8 +258,13 @@ struct neobox_global
     struct neobox_parser parser;
     struct neobox_save **save; // button save array
     struct neobox_queue queue; // event queue
+    int queue_fd;       // queue doorbell, rung by signal handlers
+    int signal_fd;      // caught signals, -1 if none
+    sigset_t signals;   // signals read from signal_fd
     struct neobox_timer timer; // timer queue
+    struct neobox_watches watches; // app fds polled in iod.epfd
     struct neobox_config config;
+    struct neobox_profile profile; // latency histograms
 };
 
 #endif
@@ -36,6 +36,7 @@
 #include <unistd.h>
 #include <linux/input.h>
 #include <math.h>
+#include <time.h>
 
 #ifdef NDEBUG
 #   define DEBUG
@@ -102,7 +103,12 @@ void signal_handler(int signal)
 void send_event(int fd, int type, int code, int value)
 {
     struct input_event event;
+    struct timespec ts;
     
+    // monotonic like iod sets on real devices
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    event.time.tv_sec = ts.tv_sec;
+    event.time.tv_usec = ts.tv_nsec/1000;
     event.type = type;
     event.code = code;
     event.value = value;